@@ -0,0 +1,10 @@
+// EEPROM is host_eeprom[], see host.c
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+#include <stdint.h>
+uint8_t eeprom_read_byte(const uint8_t *a);
+void eeprom_write_byte(uint8_t *a, uint8_t v);
+uint16_t eeprom_read_word(const uint16_t *a);
+void eeprom_write_word(uint16_t *a, uint16_t v);
+#define eeprom_busy_wait() ((void)0)
+#endif
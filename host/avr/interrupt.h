@@ -0,0 +1,12 @@
+// Interrupts on the PC are just function calls, and SREG's I bit is
+// kept up to date so we can see when they'd be allowed. cli() is also
+// where the replayer (see replay.c) gets a look in, the firmware can't
+// wait on anything without going through it
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+#define sei() (SREG |= 0x80)
+void host_cli(void);
+#define cli() host_cli()
+#define SIGNAL(v) void v(void)
+#define ISR(v) void v(void)
+#endif
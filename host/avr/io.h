@@ -0,0 +1,232 @@
+/*
+ * Just enough of avr/io.h to build the firmware on a PC, see host.c.
+ * Registers are plain variables so they can be poked and looked at.
+ * The few that the firmware busy-waits on or streams data through are
+ * special:
+ *  SPSR, UCSR0A  always read as done / ready
+ *  SPDR, UDR0    each access moves along a tape (see host.h) so that
+ *                everything written can be read back afterwards, and
+ *                received bytes can be put in the way of a read
+ *  EECR          EEPROM writes finish as they would on the chip, or
+ *                on the next access (see host_us in host.h)
+ *  ACSR          ACO follows host_aco whatever the firmware writes
+ * It's a 168 unless HOST_MCU_atmega328p is defined (see HOSTCFLAGS).
+ */
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+#include <stdint.h>
+
+#define _BV(b) (1 << (b))
+#define bit_is_set(r,b) ((r) & _BV(b))
+#define bit_is_clear(r,b) (!((r) & _BV(b)))
+#define loop_until_bit_is_set(r,b) do { } while (bit_is_clear(r,b))
+
+// the firmware's only inline asm is sleep and nop
+#define asm(x)
+
+#define REG8(n) extern volatile uint8_t n;
+#define REG16(n) extern volatile uint16_t n;
+REG8(PINB) REG8(DDRB) REG8(PORTB) REG8(PINC) REG8(DDRC) REG8(PORTC)
+REG8(PIND) REG8(DDRD) REG8(PORTD)
+REG8(TIFR0) REG8(TIFR1) REG8(TIFR2) REG8(PCIFR) REG8(EIFR) REG8(EIMSK)
+REG8(GPIOR0) REG8(EEDR) REG16(EEAR) REG8(GTCCR)
+REG8(TCCR0A) REG8(TCCR0B) REG8(TCNT0) REG8(OCR0A) REG8(OCR0B)
+REG8(SPCR) REG8(SMCR) REG8(MCUSR) REG8(MCUCR)
+REG8(SPMCSR) REG8(SREG) REG8(WDTCSR) REG8(CLKPR) REG8(PRR) REG8(OSCCAL)
+REG8(PCICR) REG8(EICRA) REG8(PCMSK0) REG8(PCMSK1) REG8(PCMSK2)
+REG8(TIMSK0) REG8(TIMSK1) REG8(TIMSK2)
+REG8(ADCL) REG8(ADCH) REG16(ADC) REG8(ADCSRA) REG8(ADCSRB) REG8(ADMUX)
+REG8(DIDR0) REG8(DIDR1)
+REG8(TCCR1A) REG8(TCCR1B) REG8(TCCR1C) REG16(TCNT1) REG16(ICR1)
+REG16(OCR1A) REG16(OCR1B)
+REG8(TCCR2A) REG8(TCCR2B) REG8(TCNT2) REG8(OCR2A) REG8(OCR2B) REG8(ASSR)
+REG8(TWBR) REG8(UCSR0B) REG8(UCSR0C) REG16(UBRR0)
+#undef REG8
+#undef REG16
+
+#define HOST_TAPE 4096  // must be a power of 2
+extern uint8_t host_spdr[HOST_TAPE], host_udr0[HOST_TAPE];
+extern uint16_t host_spdr_n, host_udr0_n;
+
+#define UCSR0A (_BV(UDRE0) | _BV(TXC0))
+#define SPDR host_spdr[host_spdr_n++ % HOST_TAPE]
+#define UDR0 host_udr0[host_udr0_n++ % HOST_TAPE]
+
+extern uint8_t host_aco;
+volatile uint8_t *host_eecr(void);
+volatile uint8_t *host_acsr(void);
+volatile uint8_t *host_spsr(void);
+#define EECR (*host_eecr())
+#define ACSR (*host_acsr())
+#define SPSR (*host_spsr())
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PC6 6
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#define EERE 0
+#define EEPE 1
+#define EEMPE 2
+#define EERIE 3
+#define EEPM0 4
+#define EEPM1 5
+#define PSRSYNC 0
+#define PSRASY 1
+#define TSM 7
+#define WGM00 0
+#define WGM01 1
+#define COM0B0 4
+#define COM0B1 5
+#define COM0A0 6
+#define COM0A1 7
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM02 3
+#define SPR0 0
+#define SPR1 1
+#define CPHA 2
+#define CPOL 3
+#define MSTR 4
+#define DORD 5
+#define SPE 6
+#define SPIE 7
+#define SPI2X 0
+#define WCOL 6
+#define SPIF 7
+#define ACIS0 0
+#define ACIS1 1
+#define ACIC 2
+#define ACIE 3
+#define ACI 4
+#define ACO 5
+#define ACBG 6
+#define ACD 7
+#define SE 0
+#define SM0 1
+#define SM1 2
+#define SM2 3
+#define PORF 0
+#define EXTRF 1
+#define BORF 2
+#define WDRF 3
+#define WDP0 0
+#define WDP1 1
+#define WDP2 2
+#define WDE 3
+#define WDCE 4
+#define WDP3 5
+#define WDIE 6
+#define WDIF 7
+#define CLKPS0 0
+#define CLKPS1 1
+#define CLKPS2 2
+#define CLKPS3 3
+#define CLKPCE 7
+#define PRADC 0
+#define PRUSART0 1
+#define PRSPI 2
+#define PRTIM1 3
+#define PRTIM0 5
+#define PRTIM2 6
+#define PRTWI 7
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define ISC00 0
+#define ISC01 1
+#define ISC10 2
+#define ISC11 3
+#define INT0 0
+#define INT1 1
+#define PCINT0 0
+#define PCINT20 4
+#define PCINT21 5
+#define TOIE0 0
+#define TOIE1 0
+#define TOIE2 0
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+#define MUX0 0
+#define MUX1 1
+#define MUX2 2
+#define MUX3 3
+#define ADLAR 5
+#define REFS0 6
+#define REFS1 7
+#define ADC0D 0
+#define ADC1D 1
+#define ADC2D 2
+#define ADC3D 3
+#define ADC4D 4
+#define ADC5D 5
+#define AIN0D 0
+#define AIN1D 1
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM22 3
+#define TCR2BUB 0
+#define TCR2AUB 1
+#define OCR2BUB 2
+#define OCR2AUB 3
+#define TCN2UB 4
+#define AS2 5
+#define EXCLK 6
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define U2X0 1
+#define RXEN0 4
+#define TXEN0 3
+#define RXCIE0 7
+#define UCSZ00 1
+#define USBS0 3
+#ifdef HOST_MCU_atmega328p
+#define RAMEND 0x8FF
+#define E2END 0x3FF
+#else
+#define RAMEND 0x4FF
+#define E2END 0x1FF
+#endif
+
+#define TOV2 0
+#define TOV0 0
+#define TOV1 0
+#endif
@@ -0,0 +1,14 @@
+// the watchdog only counts feeds here, host/replay keeps the time
+#ifndef HOST_AVR_WDT_H
+#define HOST_AVR_WDT_H
+#include <stdint.h>
+#define WDTO_2S 7
+#define WDTO_4S 8
+#define WDTO_8S 9
+#define HOST_WDT_OFF 0xFF
+extern volatile uint8_t host_wdt;  // the WDTO_ it's on, or HOST_WDT_OFF
+extern volatile uint32_t host_wdt_feeds;
+#define wdt_reset() ((void)host_wdt_feeds++)
+#define wdt_enable(x) ((void)(host_wdt = (x), host_wdt_feeds++))
+#define wdt_disable() ((void)(host_wdt = HOST_WDT_OFF))
+#endif
@@ -0,0 +1,443 @@
+/*
+ * Benchmarks for the firmware's display and formatting code, run on a
+ * PC with "make bench". Every function gets run over all its inputs
+ * (every time of day, every day of the century...) and what it does is
+ * checked against a simple model of what it should do, so changes can
+ * be timed and checked in a few seconds without a clock.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "host.h"
+#include "../util.h"
+
+// a run of one function over all its inputs
+typedef struct {
+  const char *name;
+  uint32_t (*run)(uint32_t *ops, uint8_t check); // returns how many were wrong
+} bench_t;
+
+/**************************** CHECKS *****************************/
+
+// what display[1..8] should be for a string, blanks past its end
+static uint32_t check_cells(const char *s) {
+  uint8_t i;
+  uint32_t wrong = 0;
+
+  for (i = 0; i < 8; i++)
+    if (display[i+1] != (*s ? model_char(*s++) : 0))
+      wrong = 1;
+  return wrong;
+}
+
+/**************************** BENCHMARKS *****************************/
+
+// Each of these makes one timed pass (check = 0) and then another
+// that compares every result with the model
+
+volatile uint8_t sink;  // so the compiler can't skip a call
+
+static uint32_t bench_display_time(uint32_t *ops, uint8_t check) {
+  uint32_t wrong = 0, t;
+  uint8_t h, m, s, r, h12;
+  char want[12];
+
+  for (r = 0; r < 2; r++) {
+    region = r ? REGION_EU : REGION_US;
+    for (t = 0; t < 86400; t++) {
+      h = t / 3600;
+      m = (t / 60) % 60;
+      s = t % 60;
+      display_time(h, m, s);
+      (*ops)++;
+      if (!check)
+	continue;
+
+      if (region == REGION_US) {
+	h12 = (h % 12) ? (h % 12) : 12;
+	sprintf(want, "%2d %02d %02d", h12, m, s);
+	if (!(display[0] & 0x1) != (h < 12))
+	  wrong++;
+      } else {
+	sprintf(want, "%02d %02d %02d", h, m, s);
+      }
+      wrong += check_cells(want);
+    }
+  }
+  return wrong;
+}
+
+static uint32_t bench_display_date(uint32_t *ops, uint8_t check) {
+  uint32_t wrong = 0;
+  uint8_t y, m, d, r;
+  char want[12];
+
+  for (r = 0; r < 2; r++) {
+    region = r ? REGION_EU : REGION_US;
+    for (y = 0; y < 100; y++) {
+      for (m = 1; m <= 12; m++) {
+	for (d = 1; d <= model_monthdays(m, 2000 + y); d++) {
+	  date_y = y;
+	  date_m = m;
+	  date_d = d;
+	  display_date(DATE);
+	  (*ops)++;
+	  if (!check)
+	    continue;
+
+	  if (region == REGION_US)
+	    sprintf(want, "%02d %02d %02d", m, d, y);
+	  else
+	    sprintf(want, "%02d %02d %02d", d, m, y);
+	  // the dashes are segments of their own
+	  want[2] = want[5] = 0;
+	  if ((display[3] != 0x2) || (display[6] != 0x2) ||
+	      (display[1] != model_char(want[0])) ||
+	      (display[2] != model_char(want[1])) ||
+	      (display[4] != model_char(want[3])) ||
+	      (display[5] != model_char(want[4])) ||
+	      (display[7] != model_char(want[6])) ||
+	      (display[8] != model_char(want[7])))
+	    wrong++;
+	}
+      }
+    }
+  }
+  return wrong;
+}
+
+// the weekday and month scroll past, check what gets lined up
+static uint32_t bench_display_day(uint32_t *ops, uint8_t check) {
+  uint32_t wrong = 0;
+  uint8_t y, m, d, i;
+  char want[SCROLL_MAX];
+
+  for (y = 0; y < 100; y++) {
+    for (m = 1; m <= 12; m++) {
+      for (d = 1; d <= model_monthdays(m, 2000 + y); d++) {
+	date_y = y;
+	date_m = m;
+	date_d = d;
+	display_date(DAY);
+	(*ops)++;
+	if (!check)
+	  continue;
+
+	sprintf(want, "%s %s %d", daynames[model_weekday(y, m, d)],
+		monthnames[m], d);
+	if (scroll_len != strlen(want)) {
+	  wrong++;
+	  continue;
+	}
+	for (i = 0; i < scroll_len; i++)
+	  if (scroll_strip[i] != model_char(want[i]))
+	    break;
+	wrong += (i != scroll_len);
+      }
+    }
+  }
+  scroll_stop();
+  return wrong;
+}
+
+static uint32_t bench_display_str(uint32_t *ops, uint8_t check) {
+  static const char *strs[] = {
+    "alarm on", "snoozing", "set time", "brite 90", "usa-12hr", "eur-24hr",
+    "vol high", "no alarm", "a", "", "0123456789", "zyxwvuts"
+  };
+  uint32_t wrong = 0, n;
+  uint8_t i;
+
+  for (n = 0; n < 10000; n++) {
+    for (i = 0; i < sizeof(strs) / sizeof(strs[0]); i++) {
+      memset(display, 0, DISPLAYSIZE);
+      display_str((char *)strs[i]);
+      (*ops)++;
+      if (!check)
+	continue;
+      wrong += check_cells(strs[i]);
+    }
+  }
+  return wrong;
+}
+
+// check the frames that go out to the MAX6921s
+static uint32_t bench_setdisplay(uint32_t *ops, uint8_t check) {
+  uint32_t wrong = 0, want, n;
+  uint16_t seg, at;
+  uint8_t digit, i, frame[VFD_BYTES];
+
+  for (n = 0; n < 100; n++) {
+    for (digit = 0; digit < DISPLAYSIZE; digit++) {
+      for (seg = 0; seg < 256; seg++) {
+	at = host_spdr_n;
+	setdisplay(digit, seg);
+	(*ops)++;
+	if (!check)
+	  continue;
+
+	want = 1UL << model_digitpin[digit % TUBE_CELLS];
+	for (i = 0; i < 8; i++)
+	  if (seg & _BV(i))
+	    want |= 1UL << model_segpin[i];
+	memset(frame, 0, VFD_BYTES);
+	model_putword(frame, digit / TUBE_CELLS, want);
+	if ((uint16_t)(host_spdr_n - at) != VFD_BYTES) {
+	  wrong++;
+	  continue;
+	}
+	for (i = 0; i < VFD_BYTES; i++)
+	  if (HOST_TAPE_AT(host_spdr, at + i) != frame[i])
+	    break;
+	wrong += (i != VFD_BYTES);
+      }
+    }
+  }
+  return wrong;
+}
+
+static uint32_t bench_leapyear(uint32_t *ops, uint8_t check) {
+  uint32_t wrong = 0, n;
+  uint16_t y;
+
+  for (n = 0; n < 1000; n++) {
+    for (y = 1600; y < 2800; y++) {
+      sink = leapyear(y);
+      (*ops)++;
+      if (check)
+	wrong += (!sink != !model_leap(y));
+    }
+  }
+  return wrong;
+}
+
+static uint32_t bench_dayofweek(uint32_t *ops, uint8_t check) {
+  uint32_t wrong = 0;
+  uint8_t y, m, d, want = 6;  // 1/1/2000 was a saturday
+
+  for (y = 0; y < 100; y++) {
+    for (m = 1; m <= 12; m++) {
+      for (d = 1; d <= model_monthdays(m, 2000 + y); d++) {
+	sink = dayofweek(y, m, d);
+	(*ops)++;
+	wrong += (sink != want);
+	want = (want + 1) % 7;
+      }
+    }
+  }
+  return wrong;
+}
+
+// check what went out of the uart against printf
+static uint32_t check_uart(uint16_t at, const char *want) {
+  uint16_t len = strlen(want), i;
+
+  if ((uint16_t)(host_udr0_n - at) != len)
+    return 1;
+  for (i = 0; i < len; i++)
+    if (HOST_TAPE_AT(host_udr0, at + i) != (uint8_t)want[i])
+      return 1;
+  return 0;
+}
+
+static uint32_t bench_putw_dec(uint32_t *ops, uint8_t check) {
+  uint32_t wrong = 0, w;
+  uint16_t at;
+  char want[12];
+
+  for (w = 0; w < 65536; w++) {
+    at = host_udr0_n;
+    uart_putw_dec(w);
+    (*ops)++;
+    if (!check)
+      continue;
+    sprintf(want, "%u", (unsigned)w);
+    wrong += check_uart(at, want);
+  }
+  return wrong;
+}
+
+static uint32_t bench_putdw_dec(uint32_t *ops, uint8_t check) {
+  uint32_t wrong = 0, dw = 0, step = 1;
+  uint16_t at;
+  char want[12];
+
+  // every number to 100000, then bigger and bigger steps to the top
+  while (1) {
+    at = host_udr0_n;
+    uart_putdw_dec(dw);
+    (*ops)++;
+    if (check) {
+      sprintf(want, "%lu", (unsigned long)dw);
+      wrong += check_uart(at, want);
+    }
+    if (dw > 100000)
+      step += step / 64 + 1;
+    if (dw > 0xFFFFFFFFUL - step)
+      break;
+    dw += step;
+  }
+  return wrong;
+}
+
+// the padded ones, over every width
+static uint32_t bench_putdw_decpad(uint32_t *ops, uint8_t check) {
+  uint32_t wrong = 0, dw = 0, step = 1;
+  uint16_t at;
+  uint8_t width;
+  char want[16];
+
+  while (1) {
+    for (width = 0; width <= 12; width++) {
+      at = host_udr0_n;
+      if (dw < 0x10000)
+	uart_putw_decpad(dw, width, (width & 1) ? '0' : ' ');
+      else
+	uart_putdw_decpad(dw, width, (width & 1) ? '0' : ' ');
+      (*ops)++;
+      if (check) {
+	sprintf(want, (width & 1) ? "%0*lu" : "%*lu", width, (unsigned long)dw);
+	wrong += check_uart(at, want);
+      }
+    }
+    if (dw > 1000)
+      step += step / 16 + 1;
+    if (dw > 0xFFFFFFFFUL - step)
+      break;
+    dw += step;
+  }
+  return wrong;
+}
+
+// how it was done before, dividing by powers of 10, to compare with
+static void div_putw_dec(uint16_t w) {
+  uint16_t num = 10000;
+  uint8_t started = 0;
+
+  while (num > 0) {
+    uint8_t b = w / num;
+    if (b > 0 || started || num == 1) {
+      uart_putc('0' + b);
+      started = 1;
+    }
+    w -= b * num;
+    num /= 10;
+  }
+}
+
+static void div_putdw_dec(uint32_t dw) {
+  uint32_t num = 1000000000;
+  uint8_t started = 0;
+
+  while (num > 0) {
+    uint8_t b = dw / num;
+    if (b > 0 || started || num == 1) {
+      uart_putc('0' + b);
+      started = 1;
+    }
+    dw -= b * num;
+    num /= 10;
+  }
+}
+
+static uint32_t bench_div_putw_dec(uint32_t *ops, uint8_t check) {
+  uint32_t w;
+
+  for (w = 0; w < 65536; w++) {
+    div_putw_dec(w);
+    (*ops)++;
+  }
+  return 0;
+}
+
+static uint32_t bench_div_putdw_dec(uint32_t *ops, uint8_t check) {
+  uint32_t dw = 0, step = 1;
+
+  while (1) {
+    div_putdw_dec(dw);
+    (*ops)++;
+    if (dw > 100000)
+      step += step / 64 + 1;
+    if (dw > 0xFFFFFFFFUL - step)
+      break;
+    dw += step;
+  }
+  return 0;
+}
+
+// setdisplay() as it was, a shift for each segment that's on
+static void loop_setdisplay(uint8_t digit, uint8_t segments) {
+  uint32_t d, t;
+  uint8_t i;
+
+  d = 1UL << model_digitpin[digit % TUBE_CELLS];
+  for (i = 0; i < 8; i++) {
+    if (segments & _BV(i)) {
+      t = 1;
+      t <<= model_segpin[i];
+      d |= t;
+    }
+  }
+  vfd_send(d, digit / TUBE_CELLS);
+}
+
+static uint32_t bench_loop_setdisplay(uint32_t *ops, uint8_t check) {
+  uint32_t n;
+  uint16_t seg;
+  uint8_t digit;
+
+  for (n = 0; n < 100; n++) {
+    for (digit = 0; digit < DISPLAYSIZE; digit++) {
+      for (seg = 0; seg < 256; seg++) {
+	loop_setdisplay(digit, seg);
+	(*ops)++;
+      }
+    }
+  }
+  return 0;
+}
+
+static const bench_t benches[] = {
+  { "display_time", bench_display_time },
+  { "display_date(DATE)", bench_display_date },
+  { "display_date(DAY)", bench_display_day },
+  { "display_str", bench_display_str },
+  { "setdisplay", bench_setdisplay },
+  { "leapyear", bench_leapyear },
+  { "dayofweek", bench_dayofweek },
+  { "uart_putw_dec", bench_putw_dec },
+  { "uart_putdw_dec", bench_putdw_dec },
+  { "uart_put*_decpad", bench_putdw_decpad },
+  { "old putw_dec", bench_div_putw_dec },
+  { "old putdw_dec", bench_div_putdw_dec },
+  { "old setdisplay", bench_loop_setdisplay },
+};
+
+int main(int argc, char **argv) {
+  uint32_t ops, wrong, failed = 0;
+  uint64_t start, ns;
+  uint8_t i;
+
+  host_reset();
+  printf("%-20s %10s %10s  %s\n", "", "ops", "ns/op", "check");
+  for (i = 0; i < sizeof(benches) / sizeof(bench_t); i++) {
+    // only run the ones asked for
+    if ((argc > 1) && !strstr(benches[i].name, argv[1]))
+      continue;
+
+    ops = 0;
+    start = host_nsecs();
+    benches[i].run(&ops, 0);
+    ns = host_nsecs() - start;
+    wrong = benches[i].run(&ops, 1);
+    ops /= 2;
+
+    printf("%-20s %10u %10.1f  ", benches[i].name, (unsigned)ops,
+	   (double)ns / ops);
+    if (wrong)
+      printf("%u WRONG\n", (unsigned)wrong);
+    else
+      printf("ok\n");
+    failed += wrong;
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * The hardware, for the host build. See host.h
+ */
+#include <string.h>
+#include <time.h>
+#include "host.h"
+
+#define REG8(n) volatile uint8_t n;
+#define REG16(n) volatile uint16_t n;
+REG8(PINB) REG8(DDRB) REG8(PORTB) REG8(PINC) REG8(DDRC) REG8(PORTC)
+REG8(PIND) REG8(DDRD) REG8(PORTD)
+REG8(TIFR0) REG8(TIFR1) REG8(TIFR2) REG8(PCIFR) REG8(EIFR) REG8(EIMSK)
+REG8(GPIOR0) REG8(EEDR) REG16(EEAR) REG8(GTCCR)
+REG8(TCCR0A) REG8(TCCR0B) REG8(TCNT0) REG8(OCR0A) REG8(OCR0B)
+REG8(SPCR) REG8(SMCR) REG8(MCUSR) REG8(MCUCR)
+REG8(SPMCSR) REG8(SREG) REG8(WDTCSR) REG8(CLKPR) REG8(PRR) REG8(OSCCAL)
+REG8(PCICR) REG8(EICRA) REG8(PCMSK0) REG8(PCMSK1) REG8(PCMSK2)
+REG8(TIMSK0) REG8(TIMSK1) REG8(TIMSK2)
+REG8(ADCL) REG8(ADCH) REG16(ADC) REG8(ADCSRA) REG8(ADCSRB) REG8(ADMUX)
+REG8(DIDR0) REG8(DIDR1)
+REG8(TCCR1A) REG8(TCCR1B) REG8(TCCR1C) REG16(TCNT1) REG16(ICR1)
+REG16(OCR1A) REG16(OCR1B)
+REG8(TCCR2A) REG8(TCCR2B) REG8(TCNT2) REG8(OCR2A) REG8(OCR2B) REG8(ASSR)
+REG8(TWBR) REG8(UCSR0B) REG8(UCSR0C) REG16(UBRR0)
+
+uint8_t host_spdr[HOST_TAPE], host_udr0[HOST_TAPE];
+uint16_t host_spdr_n, host_udr0_n;
+
+volatile uint8_t host_wdt;
+volatile uint32_t host_wdt_feeds;
+
+uint8_t host_eeprom[EE_SIZE];
+uint32_t host_eeprom_writes[EE_SIZE];
+
+void (*host_poll)(void);
+void (*host_eewrite)(uint16_t addr, uint8_t v);
+
+static void eeprom_put(uint16_t addr, uint8_t v) {
+  addr %= EE_SIZE;
+  host_eeprom[addr] = v;
+  host_eeprom_writes[addr]++;
+  if (host_eewrite)
+    host_eewrite(addr, v);
+}
+
+// A write finishes the next time anyone looks, or with host_us() to go
+// by it takes as long as the datasheet says: 3.4ms to erase and write,
+// 1.8ms to do just one
+static volatile uint8_t eecr;
+static uint8_t eebusy;
+static uint64_t eedone;
+uint64_t (*host_us)(void);
+
+void host_eeprom_tick(void) {
+  if (!(eecr & _BV(EEPE)))
+    return;
+  if (host_us) {
+    if (!eebusy) {
+      eebusy = 1;
+      eedone = host_us() + ((eecr & (_BV(EEPM0) | _BV(EEPM1))) ? 1800 : 3400);
+    }
+    if (host_us() < eedone)
+      return;
+  }
+  if (eecr & _BV(EEPM0))
+    eeprom_put(EEAR, 0xFF);  // erase only
+  else if (eecr & _BV(EEPM1))
+    eeprom_put(EEAR, host_eeprom[EEAR % EE_SIZE] & EEDR);  // write only
+  else
+    eeprom_put(EEAR, EEDR);
+  eecr = 0;
+  eebusy = 0;
+}
+
+// the firmware waiting on EEPE lets time go by
+volatile uint8_t *host_eecr(void) {
+  host_eeprom_tick();
+  if ((eecr & _BV(EEPE)) && host_poll)
+    host_poll();
+  return &eecr;
+}
+
+// the comparator output is ours, the rest of ACSR is the firmware's
+uint8_t host_aco;
+static volatile uint8_t acsr;
+
+volatile uint8_t *host_acsr(void) {
+  acsr = (acsr & ~_BV(ACO)) | host_aco;
+  return &acsr;
+}
+
+static volatile uint8_t spsr;
+
+volatile uint8_t *host_spsr(void) {
+  spsr |= _BV(SPIF);
+  return &spsr;
+}
+
+void host_cli(void) {
+  if (host_poll)
+    host_poll();
+  SREG &= ~0x80;
+}
+
+// like avr-libc's these wait for a write that's going, and a write is
+// left going
+uint8_t eeprom_read_byte(const uint8_t *a) {
+  while (EECR & _BV(EEPE));
+  return host_eeprom[(uintptr_t)a % EE_SIZE];
+}
+
+void eeprom_write_byte(uint8_t *a, uint8_t v) {
+  while (EECR & _BV(EEPE));
+  if (!host_us) {
+    eeprom_put((uintptr_t)a, v);
+    return;
+  }
+  EEAR = (uintptr_t)a;
+  EEDR = v;
+  eecr = _BV(EEPE);
+  host_eeprom_tick();
+}
+
+uint16_t eeprom_read_word(const uint16_t *a) {
+  return eeprom_read_byte((const uint8_t *)a) |
+    (eeprom_read_byte((const uint8_t *)a + 1) << 8);
+}
+
+void eeprom_write_word(uint16_t *a, uint16_t v) {
+  eeprom_write_byte((uint8_t *)a, v);
+  eeprom_write_byte((uint8_t *)a + 1, v >> 8);
+}
+
+// what a cell's segments look like as text, letters and numbers that
+// look the same come out as numbers
+char host_cellchar(uint8_t segs) {
+  static char chars[256];
+  uint8_t i;
+
+  if (!chars[0]) {
+    memset(chars, '?', sizeof(chars));
+    for (i = 0; i < 26; i++)
+      chars[alphatable[i]] = 'a' + i;
+    for (i = 0; i < 10; i++)
+      chars[numbertable[i]] = '0' + i;
+    chars[0x2] = '-';
+    chars[0] = ' ';
+  }
+  return chars[segs];
+}
+
+uint64_t host_nsecs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// a freshly erased chip
+void host_reset(void) {
+  memset(host_eeprom, 0xFF, sizeof(host_eeprom));
+  memset(host_eeprom_writes, 0, sizeof(host_eeprom_writes));
+  host_spdr_n = host_udr0_n = 0;
+  host_aco = 0;
+  eecr = acsr = spsr = eebusy = 0;
+  host_wdt = HOST_WDT_OFF;
+  SREG = 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Host build of the firmware, for trying things out on a PC. iv.c and
+ * util.c are compiled unchanged against the headers in here (with main
+ * renamed to iv_main) and host.c fills in the hardware.
+ */
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/wdt.h>
+#include "../iv.h"
+
+// the EEPROM, and how many times each byte got written
+extern uint8_t host_eeprom[EE_SIZE];
+extern uint32_t host_eeprom_writes[EE_SIZE];
+
+// where the tapes are up to, see avr/io.h
+#define HOST_TAPE_AT(tape, n) (tape[(n) % HOST_TAPE])
+
+uint64_t host_nsecs(void);
+void host_reset(void);
+char host_cellchar(uint8_t segs);
+
+// hooks for the replayer: host_poll() is called from every cli() (and
+// while the firmware waits on the EEPROM), host_eewrite() with every
+// byte that gets written to EEPROM and host_us() gives the time, so
+// EEPROM writes take as long as they do on the chip
+extern void (*host_poll)(void);
+extern void (*host_eewrite)(uint16_t addr, uint8_t v);
+extern uint64_t (*host_us)(void);
+void host_eeprom_tick(void);
+
+int iv_main(void);
+
+// the reference models, see model.c
+extern const char *daynames[], *monthnames[];
+uint8_t model_leap(uint16_t y);
+uint8_t model_monthdays(uint8_t m, uint16_t y);
+uint8_t model_weekday(uint8_t y, uint8_t m, uint8_t d);
+uint8_t model_char(char c);
+// the MAX6921 output for each cell's grid and each display[] bit
+extern const uint8_t model_digitpin[TUBE_CELLS], model_segpin[8];
+// chip k's 20 bits in a frame of VFD_BYTES, as it's sent
+void model_putword(uint8_t *frame, uint8_t k, uint32_t w);
+uint32_t model_getword(const uint8_t *frame, uint8_t k);
+
+// the interrupt handlers
+void SIG_OVERFLOW0(void);
+void TIMER2_OVF_vect(void);
+void SIG_INTERRUPT0(void);
+void SIG_COMPARATOR(void);
+void SIG_ADC(void);
+void USART_RX_vect(void);
+
+// and the firmware's own state that we look at
+extern uint8_t display[DISPLAYSIZE];
+extern uint8_t region;
+extern volatile uint8_t time_s, time_m, time_h;
+extern volatile uint8_t date_m, date_d, date_y;
+extern volatile uint8_t displaymode, sleepmode;
+extern volatile uint8_t alarming;
+extern volatile uint32_t ticks, rtc_uptime;
+extern volatile uint8_t rtc_step;
+extern volatile uint16_t clock_mow;
+extern uint8_t scroll_strip[SCROLL_MAX];
+extern volatile uint8_t scroll_len;
+extern const uint8_t numbertable[], alphatable[];
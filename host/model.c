@@ -0,0 +1,83 @@
+/*
+ * Simple, obviously right versions of the calendar, font and tube
+ * wiring, for the host tools to check the firmware against. See host.h
+ */
+#include "host.h"
+
+const char *daynames[] = {
+  "sunday", "monday", "tuesday", "wednesday", "thursday", "friday",
+  "saturday"
+};
+
+const char *monthnames[] = {
+  "", "january", "february", "march", "april", "may", "june", "july",
+  "august", "september", "october", "november", "december"
+};
+
+uint8_t model_leap(uint16_t y) {
+  return ((y % 4) == 0) && (((y % 100) != 0) || ((y % 400) == 0));
+}
+
+uint8_t model_monthdays(uint8_t m, uint16_t y) {
+  static const uint8_t days[] = { 0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+  return (m == 2 && model_leap(y)) ? 29 : days[m];
+}
+
+// count the days from saturday 1/1/2000
+uint8_t model_weekday(uint8_t y, uint8_t m, uint8_t d) {
+  uint32_t days = 0;
+  uint16_t i;
+
+  for (i = 2000; i < 2000 + y; i++)
+    days += model_leap(i) ? 366 : 365;
+  for (i = 1; i < m; i++)
+    days += model_monthdays(i, 2000 + y);
+  days += d - 1;
+  return (days + 6) % 7;
+}
+
+uint8_t model_char(char c) {
+  if (c >= '0' && c <= '9')
+    return numbertable[c - '0'];
+  if (c >= 'a' && c <= 'z')
+    return alphatable[c - 'a'];
+  if (c == '-')
+    return 0x2;
+  return 0;
+}
+
+// the wiring from iv.h, cell 0 is the one on the left
+const uint8_t model_digitpin[TUBE_CELLS] = {
+  DIG_9, DIG_8, DIG_7, DIG_6, DIG_5, DIG_4, DIG_3, DIG_2, DIG_1
+};
+const uint8_t model_segpin[8] = {
+  SEG_H, SEG_G, SEG_F, SEG_E, SEG_D, SEG_C, SEG_B, SEG_A
+};
+
+// the last byte sent is the bottom of the frame, where chip 0 is
+void model_putword(uint8_t *frame, uint8_t k, uint32_t w) {
+  uint16_t b;
+  uint8_t i;
+
+  for (i = 0; i < 20; i++) {
+    b = 20 * k + i;
+    if (w & (1UL << i))
+      frame[VFD_BYTES - 1 - b / 8] |= _BV(b % 8);
+    else
+      frame[VFD_BYTES - 1 - b / 8] &= ~_BV(b % 8);
+  }
+}
+
+uint32_t model_getword(const uint8_t *frame, uint8_t k) {
+  uint32_t w = 0;
+  uint16_t b;
+  uint8_t i;
+
+  for (i = 0; i < 20; i++) {
+    b = 20 * k + i;
+    if (frame[VFD_BYTES - 1 - b / 8] & _BV(b % 8))
+      w |= 1UL << i;
+  }
+  return w;
+}
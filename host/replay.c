@@ -0,0 +1,739 @@
+/*
+ * Plays a trace of what happened to a clock (buttons, the alarm switch,
+ * the mains coming and going, the light level, serial traffic) into the
+ * host build and logs what the clock did back, eg.
+ *   host/replay host/night.trace > night.log
+ * The log only depends on the firmware and the trace, so two builds can
+ * be diffed ("make compare"). How long the interrupts took on this PC
+ * (not on the chip), how much EEPROM got worn, how close the watchdog
+ * came and what was left running in each power mode, and how soon the
+ * display came up after the power did, goes to stderr. With -s every
+ * word shifted out to the MAX6921 is written to a file as well, for
+ * host/vfd to look at.
+ *
+ * With -p the serial port is a pseudo terminal as well as the trace,
+ * linked to from the given name (eg. host/tty), and time goes at the
+ * real rate so ivset.pl can be run against it.
+ *
+ * A trace is lines of "ms what value" in time order, # for comments:
+ *   buttons 0x6       the buttons held down, bit 0 is button 1
+ *   alarm on|off      the alarm switch (PD2)
+ *   power mains|battery   the comparator (ACO)
+ *   adc 0-255         the photoresistor, bigger is darker
+ *   rx a5 01 00 ff    bytes into the serial port, one a tick
+ *   end               stop here, otherwise we stop at the last line
+ *
+ * A reset starts the firmware's variables over, as the startup code
+ * would (see HOSTRAM in the Makefile), but leaves the registers be.
+ *
+ * Time only moves on when the firmware calls cli(). From main() that's
+ * one mux tick (MUX_DIVIDER timer 0 overflows with timer 2 counting the
+ * 32KHz crystal alongside), and an interrupt that sits waiting (the
+ * alarm switch debounce) gets time moved on under it a bit at a time.
+ */
+#define _GNU_SOURCE  // for the pty
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include "host.h"
+#include "../util.h"
+
+#define OVF_US (256000000UL / F_CPU)  // timer 0 overflows at F_CPU / 256
+#define SPIN_MAX 64    // this many cli()s in one interrupt is waiting
+
+// the interrupts we raise, in priority order
+enum { V_OVF0, V_OVF2, V_INT0, V_COMP, V_ADC, V_RX, VECTORS };
+
+typedef struct {
+  const char *name;
+  void (*handler)(void);
+  uint32_t calls;
+  uint64_t ns, peak;
+} vector_t;
+
+static vector_t vectors[VECTORS] = {
+  { "TIMER0_OVF", SIG_OVERFLOW0 },
+  { "TIMER2_OVF", TIMER2_OVF_vect },
+  { "INT0", SIG_INTERRUPT0 },
+  { "ANALOG_COMP", SIG_COMPARATOR },
+  { "ADC", SIG_ADC },
+  { "USART_RX", USART_RX_vect },
+};
+
+static uint64_t now;  // timer 0 overflows since we started
+static uint8_t pending, running;
+static uint8_t spins;
+
+// timer 2's clock
+static const uint16_t t2div[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+static uint32_t xtal, prescale;
+
+static uint8_t adc;
+static uint8_t rx[256], rx_head, rx_tail;
+
+static FILE *trace, *spi;
+static int pty = -1;
+static uint16_t spi_seen;
+static uint64_t spi_frames;
+static uint32_t lineno;
+static uint8_t done;
+static uint64_t wdt_fed, wdt_longest;  // in us
+
+// awake and asleep (sleepmode), what was running and how often it went
+typedef struct {
+  uint64_t us;
+  uint8_t prr, on;
+  uint32_t rtc, adc, frames, eeprom;
+} power_t;
+static power_t power[2];
+#define ON_VFD 0x1
+#define ON_BOOST 0x2
+#define ON_COMP 0x4
+
+// from the mains coming on (or a reset on mains) to the first frame
+// with anything lit, in us
+static uint64_t up_from, up_first, up_worst;
+static uint32_t up_wakes;
+static uint8_t up_waiting, up_boot = 1;
+
+// iv.c and util.c's variables, and what they start out as
+extern char __start_iv_data[], __stop_iv_data[];
+extern char __start_iv_bss[], __stop_iv_bss[];
+static char iv_data[4096];
+
+/**************************** LOG *****************************/
+
+static uint8_t shown[DISPLAYSIZE];
+static uint16_t tx_seen;
+static uint16_t spk;
+static uint8_t asleep;
+static uint32_t restarts;
+
+static void stamp(const char *what) {
+  uint64_t us = now * OVF_US;
+
+  printf("%7u.%03u %-7s", (unsigned)(us / 1000000), (unsigned)(us / 1000 % 1000), what);
+}
+
+// the display as text, cell 0 is just dots so it's in hex
+static void log_display(void) {
+  uint8_t i, c;
+
+  stamp("disp");
+  printf("%02x \"", display[0]);
+  for (i = 1; i < DISPLAYSIZE; i++) {
+    c = display[i];
+    putchar(host_cellchar(c & ~0x1));
+    if (c & 0x1)
+      putchar('.');
+  }
+  printf("\"\n");
+  memcpy(shown, display, DISPLAYSIZE);
+}
+
+static void log_uart(void) {
+  uint8_t c;
+
+  if (tx_seen == host_udr0_n)
+    return;
+  stamp("uart");
+  putchar('"');
+  for (; tx_seen != host_udr0_n; tx_seen++) {
+    c = HOST_TAPE_AT(host_udr0, tx_seen);
+    if ((pty >= 0) && (write(pty, &c, 1) != 1))
+      perror("pty");
+    if (c == '"' || c == '\\')
+      printf("\\%c", c);
+    else if (c >= ' ' && c < 0x7F)
+      putchar(c);
+    else
+      printf("\\x%02x", c);
+  }
+  printf("\"\n");
+}
+
+// how long from the mains going to the power fail slot's check byte
+// being written, the last one
+static uint64_t pf_from, pf_worst;
+static uint32_t pf_saves;
+static uint8_t pf_started;
+
+static void log_eeprom(uint16_t addr, uint8_t v) {
+  stamp("eeprom");
+  printf("%03x=%02x\n", addr, v);
+  power[sleepmode != 0].eeprom++;
+  if (!pf_from || (v == 0xFF))
+    return;
+  if (addr == EE_PF_MIN) {
+    pf_started = 1;
+  } else if ((addr == EE_PF_CHECK) && pf_started) {
+    if (now * OVF_US - pf_from > pf_worst)
+      pf_worst = now * OVF_US - pf_from;
+    pf_saves++;
+    pf_from = 0;
+  }
+}
+
+static uint64_t us(void) {
+  return now * OVF_US;
+}
+
+// look for anything that changed since the last tick
+static void watch(void) {
+  uint16_t s;
+
+  log_uart();
+  if (memcmp(shown, display, DISPLAYSIZE))
+    log_display();
+
+  s = (TCCR1B & _BV(CS11)) ? ICR1 : 0;
+  if (s != spk) {
+    spk = s;
+    stamp("spk");
+    if (s)
+      printf("%luHz\n", (unsigned long)(F_CPU / 8) / s);
+    else
+      printf("off\n");
+  }
+
+  if (sleepmode != asleep) {
+    asleep = sleepmode;
+    stamp(asleep ? "sleep" : "wake");
+    putchar('\n');
+  }
+}
+
+/**************************** WATCHDOG *****************************/
+
+static void reset(void);
+
+// the watchdog goes off 16ms << WDTO_ after the last feed, a reset
+// like any other but for MCUSR
+static void watchdog(void) {
+  static uint32_t seen;
+  uint64_t us = now * OVF_US;
+
+  if ((host_wdt == HOST_WDT_OFF) || (host_wdt_feeds != seen)) {
+    seen = host_wdt_feeds;
+    wdt_fed = us;
+    return;
+  }
+  if (us - wdt_fed > wdt_longest)
+    wdt_longest = us - wdt_fed;
+  if (us - wdt_fed >= (16000ULL << host_wdt)) {
+    stamp("wdt");
+    putchar('\n');
+    wdt_fed = us;
+    MCUSR |= _BV(WDRF);
+    reset();
+  }
+}
+
+/**************************** INTERRUPTS *****************************/
+
+static void raise(uint8_t v) {
+  pending |= _BV(v);
+}
+
+// run whatever is pending, if interrupts are on
+static void dispatch(void) {
+  uint8_t v, sreg, spun;
+  uint16_t at = 0;
+  uint64_t start, ns;
+
+  for (v = 0; v < VECTORS; v++) {
+    if (!(SREG & 0x80))
+      return;
+    if (!(pending & _BV(v)) || (running & _BV(v)))
+      continue;
+    pending &= ~_BV(v);
+    // the firmware clears TOV2 whenever it turns the RTC off, which
+    // TIFR2 here can't see
+    if (v == V_OVF2 && !(TIMSK2 & _BV(TOIE2)))
+      continue;
+
+    // the byte goes wherever the tape is up to when it's read
+    if (v == V_RX) {
+      log_uart();
+      at = host_udr0_n;
+      HOST_TAPE_AT(host_udr0, at) = rx[rx_tail++];
+    }
+
+    sreg = SREG;
+    SREG &= ~0x80;
+    running |= _BV(v);
+    spun = spins;
+    spins = 0;
+    vectors[v].calls++;  // before, the handler might not come back
+    if (v == V_OVF2)
+      power[sleepmode != 0].rtc++;
+    else if (v == V_ADC)
+      power[sleepmode != 0].adc++;
+    start = host_nsecs();
+    vectors[v].handler();
+    ns = host_nsecs() - start;
+    spins = spun;
+    running &= ~_BV(v);
+    SREG = sreg;
+
+    if (v == V_RX)
+      tx_seen = at + 1;
+    vectors[v].ns += ns;
+    if (ns > vectors[v].peak)
+      vectors[v].peak = ns;
+  }
+}
+
+// what's running this overflow
+static void account(void) {
+  power_t *p = &power[sleepmode != 0];
+
+  p->us += OVF_US;
+  p->prr = PRR;
+  p->on = 0;
+  if (!(PIN_PORT(VFDSWITCH) & PIN_MASK(VFDSWITCH)))  // high is off
+    p->on |= ON_VFD;
+  if (TCCR0B & 0x7)
+    p->on |= ON_BOOST;
+  if (!(ACSR & _BV(ACD)))
+    p->on |= ON_COMP;
+}
+
+// did this frame light anything, with the tubes powered
+static void up_frame(uint16_t at) {
+  uint8_t frame[VFD_BYTES], i, k;
+  uint32_t segs = 0;
+
+  if (!up_waiting || (PIN_PORT(VFDSWITCH) & PIN_MASK(VFDSWITCH)))
+    return;
+  for (i = 0; i < 8; i++)
+    segs |= 1UL << model_segpin[i];
+  for (i = 0; i < VFD_BYTES; i++)
+    frame[i] = HOST_TAPE_AT(host_spdr, at + i);
+  for (k = 0; k < VFD_CHIPS; k++)
+    if (model_getword(frame, k) & segs)
+      break;
+  if (k == VFD_CHIPS)
+    return;
+  up_waiting = 0;
+  if (up_boot) {
+    up_boot = 0;
+    up_first = now * OVF_US;
+  } else {
+    up_wakes++;
+    if (now * OVF_US - up_from > up_worst)
+      up_worst = now * OVF_US - up_from;
+  }
+}
+
+static void up_start(void) {
+  up_from = now * OVF_US;
+  up_waiting = 1;
+}
+
+// one timer 0 overflow's worth of time
+static void overflow(void) {
+  uint8_t i;
+
+  now++;
+  TIFR2 = 0;  // we never leave a flag set, see raise()
+  account();
+  host_eeprom_tick();
+
+  if ((TCCR0B & 0x7) && (TIMSK0 & _BV(TOIE0)))
+    raise(V_OVF0);
+
+  // 32768Hz is 1.048576 crystal ticks every 32us at 8MHz
+  if (TCCR2B & 0x7) {
+    xtal += 32768UL * OVF_US;
+    while (xtal >= 1000000) {
+      xtal -= 1000000;
+      if (++prescale < t2div[TCCR2B & 0x7])
+	continue;
+      prescale = 0;
+      if (!++TCNT2 && (TIMSK2 & _BV(TOIE2)))
+	raise(V_OVF2);
+    }
+  }
+
+  if ((ADCSRA & _BV(ADEN)) && (ADCSRA & _BV(ADSC))) {
+    ADCH = adc;
+    ADCSRA &= ~_BV(ADSC);
+    if (ADCSRA & _BV(ADIE))
+      raise(V_ADC);
+  }
+
+  dispatch();
+
+  // vfd_send() is all that uses SPI, every VFD_BYTES is one latched
+  // frame
+  while ((uint16_t)(host_spdr_n - spi_seen) >= VFD_BYTES) {
+    if (spi) {
+      fprintf(spi, "%llu ", (unsigned long long)(now * OVF_US));
+      for (i = 0; i < VFD_BYTES; i++)
+	fprintf(spi, "%02x", HOST_TAPE_AT(host_spdr, spi_seen + i));
+      fprintf(spi, "\n");
+    }
+    up_frame(spi_seen);
+    spi_seen += VFD_BYTES;
+    spi_frames++;
+    power[sleepmode != 0].frames++;
+  }
+
+  watchdog();
+}
+
+/**************************** MAIN *****************************/
+
+static ucontext_t sim_ctx, main_ctx;
+static char main_stack[1 << 20];
+static jmp_buf restart;
+static uint8_t in_main;
+
+static void main_entry(void) {
+  iv_main();
+}
+
+// called from every cli(), main() gives us a tick and interrupts that
+// keep coming back here are waiting on the time
+static void poll(void) {
+  if (in_main) {
+    in_main = 0;
+    swapcontext(&main_ctx, &sim_ctx);
+    in_main = 1;
+  } else if (++spins >= SPIN_MAX) {
+    spins = 0;
+    overflow();
+  }
+}
+
+// app_start() jumps to 0, here that's main() on a fresh stack
+static void reset(void) {
+  longjmp(restart, 1);
+}
+
+/**************************** TRACE *****************************/
+
+static void bad(const char *why) {
+  fprintf(stderr, "trace line %u: %s\n", (unsigned)lineno, why);
+  exit(2);
+}
+
+static void pin(volatile uint8_t *port, uint8_t bit, uint8_t high) {
+  if (high)
+    *port |= _BV(bit);
+  else
+    *port &= ~_BV(bit);
+}
+
+static void event(char *what, char *value) {
+  unsigned long v;
+  char *end;
+
+  if (!strcmp(what, "buttons")) {
+    // pulled up, pressed is low
+    v = strtoul(value, 0, 0);
+    pin(&PIN_IN(BUTTON1), PIN_NUM(BUTTON1), !(v & 0x1));
+    pin(&PIN_IN(BUTTON2), PIN_NUM(BUTTON2), !(v & 0x2));
+    pin(&PIN_IN(BUTTON3), PIN_NUM(BUTTON3), !(v & 0x4));
+  } else if (!strcmp(what, "alarm")) {
+    pin(&PIN_IN(ALARM), PIN_NUM(ALARM), !strcmp(value, "on"));
+    if (EIMSK & _BV(INT0))
+      raise(V_INT0);
+  } else if (!strcmp(what, "power")) {
+    host_aco = !strcmp(value, "battery") ? _BV(ACO) : 0;
+    pf_from = host_aco ? now * OVF_US : 0;
+    if (!host_aco)
+      up_start();
+    pf_started = 0;
+    if (ACSR & _BV(ACIE))
+      raise(V_COMP);
+  } else if (!strcmp(what, "adc")) {
+    adc = strtoul(value, 0, 0);
+  } else if (!strcmp(what, "rx")) {
+    for (value = strtok(value, " \t"); value; value = strtok(0, " \t")) {
+      v = strtoul(value, &end, 16);
+      if (*end || (uint8_t)(rx_head + 1) == rx_tail)
+	bad("bad rx byte");
+      rx[rx_head++] = v;
+    }
+  } else if (!strcmp(what, "end")) {
+    done = 1;
+  } else {
+    bad("don't know that");
+  }
+}
+
+// play everything that's due
+static uint64_t next = 0;
+static char what[16], value[256];
+
+static void events(void) {
+  char line[300], *p;
+  double ms;
+  int n;
+
+  while (!done) {
+    if (!next) {
+      do {
+	if (!fgets(line, sizeof(line), trace)) {
+	  done = 1;
+	  return;
+	}
+	lineno++;
+	if ((p = strchr(line, '#')))
+	  *p = 0;
+	value[0] = 0;
+      } while ((n = sscanf(line, "%lf %15s %255[^\n]", &ms, what, value)) <= 0);
+      if (n < 2)
+	bad("expected ms what value");
+      // and no space on the end, from before a comment
+      for (p = value + strlen(value); (p > value) && strchr(" \t\r", p[-1]); p--)
+	p[-1] = 0;
+      next = (uint64_t)(ms * 1000 / OVF_US) + 1;
+    }
+    if (next > now + 1)
+      return;
+    next = 0;
+    event(what, value);
+  }
+}
+
+/**************************** PTY *****************************/
+
+// a pseudo terminal with a link to it called name, that passes the
+// bytes through as they are
+static void pty_open(const char *name) {
+  struct termios t;
+  int slave;
+
+  if (((pty = posix_openpt(O_RDWR | O_NOCTTY)) < 0) ||
+      grantpt(pty) || unlockpt(pty) ||
+      ((slave = open(ptsname(pty), O_RDWR | O_NOCTTY)) < 0)) {
+    perror("pty");
+    exit(2);
+  }
+  // keep the other end open so we don't see it hang up between
+  // ivset.pl runs
+  tcgetattr(slave, &t);
+  cfmakeraw(&t);
+  tcsetattr(slave, TCSANOW, &t);
+  fcntl(pty, F_SETFL, O_NONBLOCK);
+  unlink(name);
+  if (symlink(ptsname(pty), name)) {
+    perror(name);
+    exit(2);
+  }
+}
+
+// whatever has come in since last time, and wait for the clock on the
+// wall to catch up with us
+static void pty_service(uint64_t start) {
+  uint64_t ns;
+  uint8_t c;
+
+  while (((uint8_t)(rx_head + 1) != rx_tail) && (read(pty, &c, 1) == 1))
+    rx[rx_head++] = c;
+  ns = host_nsecs() - start;
+  if (ns < now * OVF_US * 1000)
+    usleep((now * OVF_US * 1000 - ns) / 1000);
+}
+
+/**************************** STATS *****************************/
+
+// How long each power mode went on for, what it left clocked (PRR) or
+// switched on, and how often things happened in it
+static void power_stats(void) {
+  static const char *prr[8] = { "adc", "usart", "spi", "timer1", 0,
+				"timer0", "timer2", "twi" };
+  static const char *on[3] = { "vfd", "boost", "comparator" };
+  power_t *p;
+  double secs;
+  uint8_t i, m;
+
+  fprintf(stderr, "%-7s %9s %8s %8s %9s %8s  %s\n", "power", "secs",
+	  "rtc/min", "adc/s", "frames/s", "eeprom", "running");
+  for (m = 0; m < 2; m++) {
+    p = &power[m];
+    if (!p->us)
+      continue;
+    secs = p->us / 1e6;
+    fprintf(stderr, "%-7s %9.1f %8.1f %8.1f %9.1f %8u ",
+	    m ? "asleep" : "awake", secs, p->rtc * 60 / secs, p->adc / secs,
+	    p->frames / secs, (unsigned)p->eeprom);
+    for (i = 0; i < 8; i++)
+      if (prr[i] && !(p->prr & _BV(i)))
+	fprintf(stderr, " %s", prr[i]);
+    for (i = 0; i < 3; i++)
+      if (p->on & _BV(i))
+	fprintf(stderr, " %s", on[i]);
+    fprintf(stderr, "\n");
+  }
+}
+
+static void stats(uint64_t ns) {
+  uint32_t writes = 0, most = 0;
+  uint16_t a, busiest = 0;
+  uint64_t secs = now * OVF_US / 1000000;
+  uint8_t v;
+
+  fprintf(stderr, "%u:%02u:%02u simulated in %.2fs, %u restarts\n",
+	  (unsigned)(secs / 3600), (unsigned)(secs / 60 % 60),
+	  (unsigned)(secs % 60), ns / 1e9, (unsigned)restarts);
+  // wall clock time on this PC, which says what got slower or faster
+  // but nothing about how long the chip takes
+  fprintf(stderr, "%-12s %10s %14s %13s %13s\n", "interrupt", "calls",
+	  "host total ms", "host mean ns", "host peak us");
+  for (v = 0; v < VECTORS; v++) {
+    fprintf(stderr, "%-12s %10u %14.3f %13.0f %13.3f\n", vectors[v].name,
+	    (unsigned)vectors[v].calls, vectors[v].ns / 1e6,
+	    vectors[v].calls ? (double)vectors[v].ns / vectors[v].calls : 0.0,
+	    vectors[v].peak / 1e3);
+  }
+  for (a = 0; a < EE_SIZE; a++) {
+    writes += host_eeprom_writes[a];
+    if (host_eeprom_writes[a] > most) {
+      most = host_eeprom_writes[a];
+      busiest = a;
+    }
+  }
+  // the cpu sits waiting with interrupts off while a frame goes out
+  fprintf(stderr, "%u cells, %u frames a second (over the trace) of %u bytes, %.2f%% of the"
+	  " cpu sending them\n", DISPLAYSIZE,
+	  (unsigned)(secs ? spi_frames / secs : 0), VFD_BYTES,
+	  secs ? spi_frames * VFD_BYTES * 8 * VFD_SPI_DIV * 100.0 /
+	  ((double)F_CPU * now * OVF_US / 1e6) : 0.0);
+  fprintf(stderr, "watchdog fed at least every %.3fs", wdt_longest / 1e6);
+  if (host_wdt != HOST_WDT_OFF)
+    fprintf(stderr, ", goes off after %.3fs", (16000ULL << host_wdt) / 1e6);
+  fprintf(stderr, "\n");
+  power_stats();
+  if (up_first || up_wakes) {
+    fprintf(stderr, "display up %.1fms after power on", up_first / 1e3);
+    if (up_wakes)
+      fprintf(stderr, ", %.1fms after the mains came back or a reset at"
+	      " worst (%u times)", up_worst / 1e3, (unsigned)up_wakes);
+    fprintf(stderr, "\n");
+  }
+  if (pf_saves)
+    fprintf(stderr, "power fail saves %u, the slot written %.1fms after the"
+	    " mains went at worst\n", (unsigned)pf_saves, pf_worst / 1e3);
+  fprintf(stderr, "eeprom writes %u", (unsigned)writes);
+  if (writes)
+    fprintf(stderr, ", most to %03x (%u)", busiest, (unsigned)most);
+  fprintf(stderr, "\n");
+}
+
+// the EEPROM starts out as iveep.hex would program it
+static void load_eeprom(const char *name) {
+  FILE *f = fopen(name, "r");
+  unsigned len, addr, type, b, i;
+  char line[600];
+
+  if (!f) {
+    perror(name);
+    exit(2);
+  }
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, ":%2x%4x%2x", &len, &addr, &type) != 3 || type)
+      continue;
+    for (i = 0; i < len; i++)
+      if (sscanf(line + 9 + 2 * i, "%2x", &b) == 1 && addr + i < EE_SIZE)
+	host_eeprom[addr + i] = b;
+  }
+  fclose(f);
+}
+
+int main(int argc, char **argv) {
+  static uint64_t start;
+  uint16_t i;
+
+  while ((argc > 2) && (argv[1][0] == '-')) {
+    if (!strcmp(argv[1], "-s")) {
+      if (!(spi = fopen(argv[2], "w"))) {
+	perror(argv[2]);
+	return 2;
+      }
+    } else if (!strcmp(argv[1], "-p")) {
+      pty_open(argv[2]);
+      setvbuf(stdout, 0, _IOLBF, 0);  // we'll get killed
+    } else {
+      break;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+  if ((argc < 2) || (argc > 3)) {
+    fprintf(stderr, "usage: replay [-s spi.out] [-p tty] trace [eeprom.hex]\n");
+    return 2;
+  }
+  if (!(trace = fopen(argv[1], "r"))) {
+    perror(argv[1]);
+    return 2;
+  }
+
+  host_reset();
+  load_eeprom((argc > 2) ? argv[2] : "iveep.hex");
+  host_eewrite = log_eeprom;
+  host_us = us;
+  host_poll = poll;
+  if (__stop_iv_data - __start_iv_data > (long)sizeof(iv_data)) {
+    fprintf(stderr, "iv_data is too big\n");
+    return 2;
+  }
+  memcpy(iv_data, __start_iv_data, __stop_iv_data - __start_iv_data);
+
+  // nothing pressed, alarm switch off, mains on, a bright room
+  PIN_IN(BUTTON1) |= PIN_MASK(BUTTON1);
+  PIN_IN(BUTTON2) |= PIN_MASK(BUTTON2);
+  PIN_IN(BUTTON3) |= PIN_MASK(BUTTON3);
+
+  start = host_nsecs();
+  if (setjmp(restart)) {
+    log_uart();  // what it said on the way down
+    restarts++;
+    stamp("reset");
+    putchar('\n');
+  }
+  if (!host_aco && !up_waiting)
+    up_start();
+  memcpy(__start_iv_data, iv_data, __stop_iv_data - __start_iv_data);
+  memset(__start_iv_bss, 0, __stop_iv_bss - __start_iv_bss);
+  app_start = reset;
+  in_main = 0;
+  running = 0;
+  spins = 0;
+  SREG = 0;
+  getcontext(&main_ctx);
+  main_ctx.uc_stack.ss_sp = main_stack;
+  main_ctx.uc_stack.ss_size = sizeof(main_stack);
+  main_ctx.uc_link = 0;
+  makecontext(&main_ctx, main_entry, 0);
+
+  while (1) {
+    events();
+    if (done)
+      break;
+    for (i = 0; i < MUX_DIVIDER; i++)
+      overflow();
+    if (rx_head != rx_tail && (UCSR0B & _BV(RXCIE0)))
+      raise(V_RX);
+    spins = 0;
+    in_main = 1;
+    swapcontext(&sim_ctx, &main_ctx);
+    in_main = 0;
+    watch();
+    if (pty >= 0)
+      pty_service(start);
+  }
+  watch();
+  stats(host_nsecs() - start);
+  if (spi)
+    fclose(spi);
+  return 0;
+}
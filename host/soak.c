@@ -0,0 +1,132 @@
+/*
+ * Runs the clock through a century as fast as the RTC interrupt will go,
+ * eg. "host/soak 100 1" for 100 years a second at a time (the step can
+ * go up to 59). It's the clock as it runs on battery, nothing but the
+ * time keeping. Every day the date, weekday, minute of the week and the
+ * rendered date are checked against the model calendar, and the EEPROM
+ * writes are counted for each year. Then days that don't exist (2/30
+ * and so on) are checked to roll on to the next month.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host.h"
+
+#define EE_LIFE 100000UL  // writes a byte is good for
+
+static uint32_t wrong;
+
+static void check(uint8_t ok, const char *what, uint8_t y, uint8_t m, uint8_t d) {
+  if (ok)
+    return;
+  if (++wrong <= 10)
+    fprintf(stderr, "%s wrong on %u/%u/20%02u\n", what, m, d, y);
+}
+
+// the date as display_date(DATE) puts it up in the US
+static uint8_t date_ok(uint8_t y, uint8_t m, uint8_t d) {
+  char want[12];
+  uint8_t i;
+
+  region = REGION_US;
+  display_date(DATE);
+  sprintf(want, "%02u-%02u-%02u", m, d, y);
+  for (i = 0; i < 8; i++)
+    if (display[i+1] != model_char(want[i]))
+      return 0;
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  uint32_t years = (argc > 1) ? atoi(argv[1]) : 100;
+  uint8_t step = (argc > 2) ? atoi(argv[2]) : 1;
+  uint8_t y = 0, m = 1, d = 1, wd;
+  uint32_t year = 0, days = 0, writes, last = 0, most = 0, fewest = 0xFFFFFFFF;
+  uint64_t calls = 0, start, ns;
+  uint16_t a, busiest = 0;
+
+  if (!years || !step || (step > 59)) {
+    fprintf(stderr, "usage: soak [years] [step 1-59]\n");
+    return 2;
+  }
+
+  // midnight on 1/1/2000, asleep on battery
+  host_reset();
+  time_h = time_m = time_s = 0;
+  date_y = 0;
+  date_m = 1;
+  date_d = 1;
+  sleepmode = 1;
+  rtc_step = step;
+  clock_sync();
+
+  start = host_nsecs();
+  while (year < years) {
+    TIMER2_OVF_vect();
+    calls++;
+    if (date_d == d)
+      continue;
+
+    // a new day, where the model says we should be
+    if (++d > model_monthdays(m, 2000 + y)) {
+      d = 1;
+      if (++m > 12) {
+	m = 1;
+	if (++y == 100)
+	  y = 0;
+
+	// and a new year
+	for (writes = 0, a = 0; a < EE_SIZE; a++)
+	  writes += host_eeprom_writes[a];
+	if (writes - last > most)
+	  most = writes - last;
+	if (writes - last < fewest)
+	  fewest = writes - last;
+	last = writes;
+	year++;
+      }
+    }
+    days++;
+    wd = model_weekday(y, m, d);
+
+    check((date_y == y) && (date_m == m) && (date_d == d), "date", y, m, d);
+    check(!time_h && !time_m, "midnight", y, m, d);
+    check(dayofweek(date_y, date_m, date_d) == wd, "dayofweek", y, m, d);
+    check(clock_mow == wd * MINS_PER_DAY, "minute of week", y, m, d);
+    check(date_ok(y, m, d), "display", y, m, d);
+
+    // put it back how the model has it, so one mistake isn't 1000
+    date_y = y;
+    date_m = m;
+    date_d = d;
+    clock_mow = wd * MINS_PER_DAY + time_h * 60 + time_m;
+  }
+  ns = host_nsecs() - start;
+
+  // days past the end of the month (from the date menu) go on to the 1st
+  // of the next one
+  for (m = 1; m <= 12; m++) {
+    for (d = model_monthdays(m, 2001) + 1; d <= 31; d++) {
+      date_y = 1;
+      date_m = m;
+      date_d = d;
+      TIMER2_OVF_vect();
+      check((date_d == 1) && (date_m == (m % 12) + 1) &&
+	    (date_y == ((m == 12) ? 2 : 1)), "day past the month", 1, m, d);
+    }
+  }
+
+  for (a = 0; a < EE_SIZE; a++)
+    if (host_eeprom_writes[a] > host_eeprom_writes[busiest])
+      busiest = a;
+
+  printf("%u years, %llu interrupts in %.2fs: %.2f ns/interrupt, %.1f years/s\n",
+	 (unsigned)years, (unsigned long long)calls, ns / 1e9,
+	 (double)ns / calls, years / (ns / 1e9));
+  printf("%u days checked, %u wrong\n", (unsigned)days, (unsigned)wrong);
+  printf("eeprom writes a year: %u to %u, most to %03x (%u a year, worn out"
+	 " in %.1f years)\n", (unsigned)fewest, (unsigned)most, busiest,
+	 (unsigned)(host_eeprom_writes[busiest] / years),
+	 (double)EE_LIFE * years / host_eeprom_writes[busiest]);
+  return wrong ? 1 : 0;
+}
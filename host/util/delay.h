@@ -0,0 +1,3 @@
+// Nothing to wait for on the PC
+#define _delay_ms(x) ((void)(x))
+#define _delay_us(x) ((void)(x))
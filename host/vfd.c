@@ -0,0 +1,223 @@
+/*
+ * What the tube would actually show, worked out from the words the
+ * firmware shifts out to the MAX6921s (see replay -s). Each chip's word
+ * is mapped back through the wiring (model_digitpin and model_segpin),
+ * and every sweep through the cells is a frame, eg.
+ *   host/replay -s host/spi.out host/night.trace > /dev/null
+ *   host/vfd -r host/spi.out
+ * -r prints the frames as text whenever they change. The report is how
+ * long each cell was lit and how often, how long more than one grid was
+ * on at once (ghosting, the segments show on both) and how many frames
+ * caught the display halfway between two pictures (tearing).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host.h"
+
+#define GAP_US 100000  // this long without a word and the tube is off
+
+typedef struct {
+  uint64_t on;        // us lit
+  uint32_t lit;       // times it came on
+  uint64_t last;      // when it last came on
+  uint32_t gap_min, gap_max;
+} cell_t;
+
+static cell_t cells[DISPLAYSIZE];
+static int8_t gridcell[20];  // MAX6921 output to cell of its tube
+static int8_t segment[20];   // and to segment bit
+
+static uint64_t ghost_us, dark_us, total_us;
+static uint32_t words, frames, changes, torn, strays;
+static uint8_t render;
+
+// the last three frames, we only know a frame was torn once we've seen
+// the one after it
+static uint8_t frame[3][DISPLAYSIZE];
+static uint64_t frame_t[3];
+static uint64_t seen;
+
+static void print_frame(const char *what, uint64_t t, uint8_t *f) {
+  uint8_t i;
+
+  printf("%7u.%03u %-5s %02x \"", (unsigned)(t / 1000000),
+	 (unsigned)(t / 1000 % 1000), what, f[0]);
+  for (i = 1; i < DISPLAYSIZE; i++) {
+    putchar(host_cellchar(f[i] & ~0x1));
+    if (f[i] & 0x1)
+      putchar('.');
+  }
+  printf("\"\n");
+}
+
+// a frame is torn if it's neither the picture before nor the one after
+// but every cell is from one or the other
+static uint8_t is_torn(uint8_t *a, uint8_t *b, uint8_t *c) {
+  uint8_t i;
+
+  if (!memcmp(a, b, DISPLAYSIZE) || !memcmp(b, c, DISPLAYSIZE) ||
+      !memcmp(a, c, DISPLAYSIZE))
+    return 0;
+  for (i = 0; i < DISPLAYSIZE; i++)
+    if ((b[i] != a[i]) && (b[i] != c[i]))
+      return 0;
+  return 1;
+}
+
+static void end_frame(void) {
+  if (!seen)
+    return;
+  frames++;
+  if (frames >= 3 && is_torn(frame[0], frame[1], frame[2])) {
+    torn++;
+    if (render)
+      print_frame("torn", frame_t[1], frame[1]);
+  }
+  if ((frames == 1) || memcmp(frame[1], frame[2], DISPLAYSIZE)) {
+    changes++;
+    if (render)
+      print_frame("tube", frame_t[2], frame[2]);
+  }
+
+  memmove(frame[0], frame[1], 2 * DISPLAYSIZE);
+  memmove(frame_t, frame_t + 1, 2 * sizeof(frame_t[0]));
+  memset(frame[2], 0, DISPLAYSIZE);
+  seen = 0;
+}
+
+static void word(uint64_t t, uint8_t *bytes) {
+  static uint64_t last_t;
+  static uint32_t last_w[VFD_CHIPS];
+  uint8_t i, k, n = 0, segs, cell;
+  uint32_t dt, w;
+
+  // the last word was up until now
+  if (words && (t - last_t < GAP_US)) {
+    dt = t - last_t;
+    total_us += dt;
+    for (k = 0; k < VFD_CHIPS; k++)
+      for (i = 0; i < 20; i++)
+	if ((last_w[k] & (1UL << i)) && (gridcell[i] >= 0)) {
+	  cells[k * TUBE_CELLS + gridcell[i]].on += dt;
+	  n++;
+	}
+    if (!n)
+      dark_us += dt;
+    else if (n > 1)
+      ghost_us += dt;
+  } else {
+    // the tube was off, start over
+    end_frame();
+    memset(last_w, 0, sizeof(last_w));
+  }
+  words++;
+
+  for (k = 0; k < VFD_CHIPS; k++) {
+    w = model_getword(bytes, k);
+    segs = 0;
+    for (i = 0; i < 20; i++)
+      if ((w & (1UL << i)) && (segment[i] >= 0))
+	segs |= _BV(segment[i]);
+      else if ((w & (1UL << i)) && (gridcell[i] < 0))
+	strays++;
+
+    for (i = 0; i < 20; i++) {
+      cell_t *c;
+
+      if (!(w & (1UL << i)) || (gridcell[i] < 0))
+	continue;
+      cell = k * TUBE_CELLS + gridcell[i];
+      c = &cells[cell];
+      // coming back round to a cell is the next frame
+      if (seen & (1ULL << cell))
+	end_frame();
+      if (!seen)
+	frame_t[2] = t;
+      seen |= 1ULL << cell;
+      frame[2][cell] = segs;
+
+      if (last_w[k] & (1UL << i))
+	continue;
+      if (c->lit && (t - c->last < GAP_US)) {
+	if (!c->gap_min || (t - c->last < c->gap_min))
+	  c->gap_min = t - c->last;
+	if (t - c->last > c->gap_max)
+	  c->gap_max = t - c->last;
+      }
+      c->lit++;
+      c->last = t;
+    }
+    last_w[k] = w;
+  }
+
+  last_t = t;
+}
+
+static void report(void) {
+  double secs = total_us / 1e6;
+  uint8_t i;
+
+  printf("%u words, %u frames at %.1fHz over %.1fs\n", (unsigned)words,
+	 (unsigned)frames, secs ? frames / secs : 0.0, secs);
+  printf("%u changes, %u torn frames, %u stray bits\n", (unsigned)changes,
+	 (unsigned)torn, (unsigned)strays);
+  printf("%-5s %8s %12s %12s %12s\n", "cell", "on %", "refresh Hz",
+	 "gap min ms", "gap max ms");
+  for (i = 0; i < DISPLAYSIZE; i++)
+    printf("%-5u %8.2f %12.1f %12.3f %12.3f\n", i,
+	   secs ? cells[i].on / (secs * 1e4) : 0.0,
+	   secs ? cells[i].lit / secs : 0.0,
+	   cells[i].gap_min / 1e3, cells[i].gap_max / 1e3);
+  printf("ghosting %.3f%% (more than one grid on), dark %.3f%% (no grid on)\n",
+	 secs ? ghost_us / (secs * 1e4) : 0.0,
+	 secs ? dark_us / (secs * 1e4) : 0.0);
+}
+
+int main(int argc, char **argv) {
+  unsigned long long t;
+  char hex[80];
+  uint8_t bytes[VFD_BYTES];
+  unsigned b;
+  FILE *f;
+  uint8_t i;
+
+  if ((argc > 1) && !strcmp(argv[1], "-r")) {
+    render = 1;
+    argc--;
+    argv++;
+  }
+  if (argc != 2) {
+    fprintf(stderr, "usage: vfd [-r] spi.out\n");
+    return 2;
+  }
+  if (!(f = fopen(argv[1], "r"))) {
+    perror(argv[1]);
+    return 2;
+  }
+
+  memset(gridcell, -1, sizeof(gridcell));
+  memset(segment, -1, sizeof(segment));
+  for (i = 0; i < TUBE_CELLS; i++)
+    gridcell[model_digitpin[i]] = i;
+  for (i = 0; i < 8; i++)
+    segment[model_segpin[i]] = i;
+
+  // each line is when and the frame's bytes in hex, in the order sent
+  while (fscanf(f, "%llu %79s", &t, hex) == 2) {
+    if (strlen(hex) != 2 * VFD_BYTES) {
+      fprintf(stderr, "%s: frames should be %u bytes\n", argv[1], VFD_BYTES);
+      return 2;
+    }
+    for (i = 0; i < VFD_BYTES; i++) {
+      sscanf(hex + 2 * i, "%2x", &b);
+      bytes[i] = b;
+    }
+    word(t, bytes);
+  }
+  end_frame();
+  fclose(f);
+
+  report();
+  return 0;
+}
@@ -53,12 +53,19 @@ volatile uint8_t volume;
 // whether the auto dimmer is turned on, and brightness set by user
 volatile uint8_t dimmer_on, brightness_level;
 
-// whether the alarm is on, going off, and alarm time
-volatile uint8_t alarm_on, alarming, alarm_h, alarm_m;
+// whether the alarm is on, going off, and the alarm times
+volatile uint8_t alarm_on, alarming;
+volatile alarm_t alarms[ALARMS];
+
+// the minute of the week (sunday 00:00 is 0) now, and of the next alarm
+volatile uint16_t clock_mow, alarm_next = MOW_NONE;
 
 // what is being displayed on the screen? (eg time, date, menu...)
 volatile uint8_t displaymode;
 
+// a soft reset, for when we wake up
+void (*app_start)(void) = 0x0000;
+
 // are we in low power sleep mode?
 volatile uint8_t sleepmode = 0;
 
@@ -68,46 +75,108 @@ volatile uint8_t restored = 0;
 // Our display buffer, which is updated to show the time/date/etc
 // and is multiplexed onto the tube
 uint8_t display[DISPLAYSIZE]; // stores segments, not values!
+uint8_t attr[DISPLAYSIZE];    // ATTR_* for each cell
+uint8_t blink[DISPLAYSIZE];   // the segments of each cell that blink
 uint8_t currdigit = 0;        // which digit we are currently multiplexing
+uint8_t dimnow = 0;           // the cell that's lit is ATTR_DIM
 
-// This table allow us to index between what digit we want to light up
-// and what the pin number is on the MAX6921 see the .h for values.
-// Stored in ROM (PROGMEM) to save RAM
-const uint8_t digittable[] PROGMEM = {
-  DIG_9, DIG_8, DIG_7, DIG_6, DIG_5, DIG_4, DIG_3, DIG_2, DIG_1
-};
-PGM_P digittable_p PROGMEM = digittable;
+// Divides the tick down for blinking, blinkoff is set for the half of
+// the time the blinking segments are off
+uint16_t blinkdiv = 0;
+uint8_t blinkoff = 0;
 
-// This table allow us to index between what segment we want to light up
-// and what the pin number is on the MAX6921 see the .h for values.
+// These tables are the MAX6921 words for a digit and for the segments
+// it shows, worked out by the compiler from the wiring in iv.h so a
+// different tube only needs its SEG_ and DIG_ pins changed there.
+// setdisplay() just ORs a digit and the two halves of the segments.
 // Stored in ROM (PROGMEM) to save RAM
-const uint8_t segmenttable[] PROGMEM = {
-  SEG_H, SEG_G,  SEG_F,  SEG_E,  SEG_D,  SEG_C,  SEG_B,  SEG_A 
+const uint32_t digitbits[TUBE_CELLS] PROGMEM = {
+  _BV32(DIG_9), _BV32(DIG_8), _BV32(DIG_7), _BV32(DIG_6), _BV32(DIG_5),
+  _BV32(DIG_4), _BV32(DIG_3), _BV32(DIG_2), _BV32(DIG_1)
 };
-PGM_P segmenttable_p PROGMEM = segmenttable;
 
-// muxdiv and MUX_DIVIDER divides down a high speed interrupt (31.25KHz)
-// down so that we can refresh at about 100Hz (31.25KHz / 300)
-// We refresh the entire display at 100Hz so each digit is updated
-// 100Hz/DISPLAYSIZE
+// display[] bits 0-3 are segments H, G, F and E, bits 4-7 are D to A
+#define SEGS_LO(n) SEGBITS(n, SEG_H, SEG_G, SEG_F, SEG_E)
+#define SEGS_HI(n) SEGBITS(n, SEG_D, SEG_C, SEG_B, SEG_A)
+const uint32_t segbits_lo[16] PROGMEM = NIBBLE_TABLE(SEGS_LO);
+const uint32_t segbits_hi[16] PROGMEM = NIBBLE_TABLE(SEGS_HI);
+
+// muxdiv and MUX_DIVIDER divides down a high speed interrupt (31.25KHz
+// at 8MHz) so that we refresh the entire display at about REFRESH_HZ,
+// each digit is updated REFRESH_HZ * DISPLAYSIZE times a second
 uint16_t muxdiv = 0;
-#define MUX_DIVIDER (300 / DISPLAYSIZE)
 
-// Likewise divides 100Hz down to 1Hz for the alarm beeping
+// Divides the tick down for polling the buttons
+uint8_t scandiv = 0;
+
+// Likewise divides the tick down for the alarm beeping, on and off.
+// It turns over one tick after it passes ALARM_DIVIDER
 uint16_t alarmdiv = 0;
-#define ALARM_DIVIDER 100
+#define ALARM_DIVIDER (MS_TO_TICKS(ALARM_BEEP_MS) - 1)
 
 // How long we have been snoozing
 uint16_t snoozetimer = 0;
 
-// We have a non-blocking delay function, milliseconds is updated by
-// an interrupt
-volatile uint16_t milliseconds = 0;
+// Tunes are lists of notes in ROM (timer 1 TOPs, see TONE), each played
+// as a 200ms beep
+// and 200ms of quiet, ending with a 0
+const uint16_t tune_beep[] PROGMEM = { TONE(4000), 0 };
+const uint16_t tune_wake[] PROGMEM = { TONE(880), TONE(1760), TONE(3520), 0 };
+
+const uint16_t *tune = 0;   // next note to play, 0 when we're done
+uint8_t tune_on = 0;        // are we in the beep or the quiet part?
+uint32_t tune_deadline;
+
+// The stopwatch/countdown timer, see STOPWATCH below. It counts in the
+// mux interrupt so it keeps going whatever is on the display
+volatile uint8_t sw_run = 0;       // 0 when stopped, or SW_UP/SW_DOWN
+uint8_t sw_dir = SW_UP;            // which way it goes when started
+uint16_t sw_us = 0;                // microseconds into this hundredth
+volatile uint8_t sw_cs, sw_s, sw_m; // hundredths, seconds, minutes
+
+// Text that's too long for the tube scrolls across it, see scroll_str()
+uint8_t scroll_strip[SCROLL_MAX];  // the whole message, as segments
+volatile uint8_t scroll_len = 0;   // 0 when there's nothing scrolling
+uint8_t scroll_pos;
+uint16_t scroll_rate, scroll_div;  // ticks per step, and till the next
+
+// The mux stage doubles as our system tick. ticks is a free running
+// counter that is never reset, so any number of callers (including
+// interrupts) can time things against it at once. One tick is exactly
+// 256 * MUX_DIVIDER cpu clocks: 1056us at 8MHz with a 9 digit display
+volatile uint32_t ticks = 0;
+
+// read the tick counter without an interrupt tearing the 4 bytes
+uint32_t ticks_now(void) {
+  uint8_t sreg = SREG;
+  uint32_t now;
+
+  cli();
+  now = ticks;
+  SREG = sreg;
+  return now;
+}
+
+// returns a deadline 'ms' milliseconds (rounded up to a tick) from now
+uint32_t timer_start(uint16_t ms) {
+  return ticks_now() + MS_TO_TICKS(ms);
+}
+
+// true once the deadline has passed, works across the 32 bit wrap
+uint8_t timer_expired(uint32_t deadline) {
+  return ((int32_t)(ticks_now() - deadline) >= 0);
+}
+
+// We have a delay function that is safe to call from interrupts and
+// from main at the same time, each caller waits on its own deadline.
+// It doesn't check in, an interrupt stuck in here has to starve main()
 void delayms(uint16_t ms) {
+  uint32_t deadline;
+
   sei();
 
-  milliseconds = 0;
-  while (milliseconds < ms);
+  deadline = timer_start(ms);
+  while (!timer_expired(deadline));
 }
 
 // When the alarm is going off, pressing a button turns on snooze mode
@@ -120,8 +189,52 @@ void setsnooze(void) {
   DEBUGP("snooze");
   display_str("snoozing");
   displaymode = SHOW_SNOOZE;
-  delayms(1000);
-  displaymode = SHOW_TIME;
+  status_show(STATUS_DONE, 1000);
+}
+
+// Status messages (alarm on, snoozing...) stay up for a while and then
+// go back to the clock. Rather than waiting around for that, we set
+// what to show next and main() gets to it when the time comes
+volatile uint8_t status_step = STATUS_NONE;
+volatile uint32_t status_deadline;
+
+void status_show(uint8_t next, uint16_t ms) {
+  uint8_t sreg = SREG;
+
+  cli();
+  status_deadline = timer_start(ms);
+  status_step = next;
+  SREG = sreg;
+}
+
+void status_service(void) {
+  uint8_t sreg = SREG;
+  uint32_t deadline;
+
+  if (status_step == STATUS_NONE)
+    return;
+
+  cli();
+  deadline = status_deadline;
+  SREG = sreg;
+  if (!timer_expired(deadline))
+    return;
+
+  switch (status_step) {
+  case STATUS_ALARMTIME:
+    // show when the alarm will go off next
+    if (alarm_next == MOW_NONE) {
+      display_str("no alarm");
+    } else {
+      display_alarm((alarm_next % MINS_PER_DAY) / 60, alarm_next % 60);
+    }
+    status_show(STATUS_DONE, 1000);
+    break;
+  default:
+    // after a second, go back to clock mode
+    status_step = STATUS_NONE;
+    displaymode = SHOW_TIME;
+  }
 }
 
 // we reset the watchdog timer 
@@ -129,33 +242,83 @@ void kickthedog(void) {
   wdt_reset();
 }
 
-// called @ (F_CPU/256) = ~30khz (31.25 khz)
+// Rather than feeding the watchdog from wherever we happen to be, each
+// task (main loop, display mux) checks in as it runs and the RTC only
+// feeds the dog once a second if they all have. If any of them hangs,
+// or the RTC itself does, the watchdog resets us. main() checks in once
+// a time round its loop (or menu_wait()'s, when it's in a menu) and
+// nowhere else, so an interrupt that never returns stops it.
+// WDT_TIMEOUT is 4s so a task that misses one second is let off: that's
+// 2s between feeds, 3s if the watchdog's oscillator runs 25% fast
+volatile uint8_t checkins = 0;
+
+void checkin(uint8_t task) {
+  uint8_t sreg = SREG;
+
+  cli();
+  checkins |= task;
+  SREG = sreg;
+}
+
+// called @ (F_CPU/256) = 31.25khz at 8MHz, 62.5khz at 16MHz
 SIGNAL (SIG_OVERFLOW0) {
+  uint8_t segs;
+
   // allow other interrupts to go off while we're doing display updates
   sei();
 
-  // kick the dog
-  kickthedog();
-
   // divide down to 100Hz * digits
   muxdiv++;
-  if (muxdiv < MUX_DIVIDER)
+  if (muxdiv < MUX_DIVIDER) {
+    // a dim cell goes off a quarter of the way through
+    if ((muxdiv == MUX_DIVIDER / 4) && dimnow)
+      vfd_send(0, 0);
     return;
+  }
   muxdiv = 0;
   // now at 100Hz * digits
 
-  // ok its not really 1ms but its like within 10% :)
-  milliseconds++;
+  // one system tick, see TICK_US
+  ticks++;
+  checkin(CHECKIN_MUX);
+
+  if (++blinkdiv >= MS_TO_TICKS(BLINK_MS)) {
+    blinkdiv = 0;
+    blinkoff = !blinkoff;
+  }
 
   // Cycle through each digit in the display
   if (currdigit >= DISPLAYSIZE)
     currdigit = 0;
 
-  // Set the current display's segments
-  setdisplay(currdigit, display[currdigit]);
+  // Set the current display's segments, with its attributes on top
+  segs = display[currdigit];
+  if (attr[currdigit] & ATTR_DOT)
+    segs |= 0x1;
+  if (blinkoff)
+    segs &= ~blink[currdigit];
+  dimnow = attr[currdigit] & ATTR_DIM;
+  setdisplay(currdigit, segs);
   // and go to the next
   currdigit++;
 
+  // play any beeps that are queued up
+  if (tune && !alarming)
+    tune_service();
+
+  if (sw_run)
+    stopwatch_tick();
+
+  if (scroll_len)
+    scroll_tick();
+
+  // look at the buttons every few ms
+  scandiv++;
+  if (scandiv >= BUTTON_SCAN_TICKS) {
+    scandiv = 0;
+    buttons_scan();
+  }
+
   // check if we should have the alarm on
   if (alarming && !snoozetimer) {
     alarmdiv++;
@@ -164,10 +327,10 @@ SIGNAL (SIG_OVERFLOW0) {
     } else {
       return;
     }
-    // This part only gets reached at 1Hz
+    // This part only gets reached every ALARM_BEEP_MS
 
     // This sets the buzzer frequency
-    ICR1 = 250;
+    ICR1 = TONE(ALARM_HZ);
     OCR1A = OCR1B = ICR1/2;
 
     // ok alarm is ringing!
@@ -183,92 +346,179 @@ SIGNAL (SIG_OVERFLOW0) {
 }
 
 
-// We use the pin change interrupts to detect when buttons are pressed
+// We poll the buttons from the mux interrupt every BUTTON_SCAN_TICKS
+// and turn what they do into gestures: presses, auto-repeat that speeds
+// up the longer you hold, long presses, double presses and chords
 
-// These store the current button states for all 3 buttons. We can 
-// then query whether the buttons are pressed and released or pressed
-// This allows for 'high speed incrementing' when setting the time
-volatile uint8_t last_buttonstate = 0, just_pressed = 0, pressed = 0;
-volatile uint8_t buttonholdcounter = 0;
+// What's held down right now, for all 3 buttons
+volatile uint8_t pressed = 0;
 
-// This interrupt detects switches 1 and 3
-SIGNAL(SIG_PIN_CHANGE2) {
-  // allow interrupts while we're doing this
-  sei();
+// Gestures go to main() through a small ring of events. buttons_scan()
+// is the only thing that adds to it and main() (or a menu) the only
+// thing that takes from it, so each end only ever writes its own index
+// and neither has to turn interrupts off. If main() falls behind we
+// keep the oldest events and count the ones we drop. The barriers make
+// sure the slot is written before the head moves on past it, and read
+// before the tail does
+input_event_t events[EVENT_QUEUE];
+volatile uint8_t event_head = 0, event_tail = 0;
+uint8_t events_lost = 0;
 
-  if (! (PIND & _BV(BUTTON1))) {
-    // button1 is pressed
-    if (! (last_buttonstate & 0x1)) { // was not pressed before
-      delayms(10);                    // debounce
-      if (PIND & _BV(BUTTON1))        // filter out bounces
-	return;
-      tick();                         // make a noise
-      // check if we will snag this button press for snoozing
-      if (alarming) {
-	// turn on snooze
-	setsnooze();
-	return;
-      }
-      last_buttonstate |= 0x1;
-      just_pressed |= 0x1;
-      DEBUGP("b1");
-    }
+void event_push(uint8_t what) {
+  uint8_t head = event_head;
+
+  if ((uint8_t)(head - event_tail) >= EVENT_QUEUE) {
+    events_lost++;
+    return;
+  }
+  events[head % EVENT_QUEUE].what = what;
+  events[head % EVENT_QUEUE].when = ticks;
+  barrier();
+  event_head = head + 1;  // only now can main() see it
+}
+
+uint8_t event_pop(input_event_t *e) {
+  uint8_t tail = event_tail;
+
+  if (tail == event_head)
+    return 0;
+  barrier();
+  *e = events[tail % EVENT_QUEUE];
+  barrier();
+  event_tail = tail + 1;
+  return 1;
+}
+
+// Which gestures each displaymode wants, so e.g. button 3 only repeats
+// in the menus. Buttons with long, double or chord gestures turned on
+// report their plain press when released rather than when pushed
+const gesture_t gesturetable[] PROGMEM = {
+  // repeat  long   double  chord
+  {  0,      0,     0x1,    0x6 },  // SHOW_TIME
+  {  0,      0,     0,      0   },  // SHOW_DATE
+  {  0,      0,     0,      0   },  // SHOW_ALARM
+  {  0x4,    0x1,   0,      0   },  // SET_TIME
+  {  0x4,    0x1,   0,      0   },  // SET_ALARM
+  {  0x4,    0x1,   0,      0   },  // SET_DATE
+  {  0x4,    0x1,   0,      0   },  // SET_BRIGHTNESS
+  {  0,      0x1,   0,      0   },  // SET_VOLUME
+  {  0,      0x1,   0,      0   },  // SET_REGION
+  {  0,      0,     0,      0   },  // SHOW_SNOOZE
+  {  0x4,    0x1,   0,      0   },  // SET_SNOOZE
+  {  0,      0x1,   0,      0   },  // SET_DIMMER
+  {  0x4,    0x2,   0,      0   },  // SHOW_STOPWATCH
+  {  0,      0,     0,      0   },  // SHOW_SCROLL
+};
+
+uint8_t lastraw = 0;          // last reading, for debouncing
+uint8_t swallowed = 0;        // buttons to ignore until they're let go
+uint8_t btn_next[3];          // scans until the next repeat / long press
+uint8_t btn_rate[3];          // current repeat rate, in scans
+uint8_t btn_taps[3];          // scans left to see a second press in
+uint8_t deferred = 0;         // buttons down whose press waits for release
+uint8_t clicking = 0;         // see tick()
+
+void buttons_scan(void) {
+  uint8_t raw, now, down, up, defer, b, bit;
+  gesture_t g;
+
+  // finish off any click we're making
+  if (clicking)
+    tick_service();
+
+  raw = 0;
+  if (!pin_read(BUTTON1))
+    raw |= 0x1;
+  if (!pin_read(BUTTON2))
+    raw |= 0x2;
+  if (!pin_read(BUTTON3))
+    raw |= 0x4;
+
+  // debounce: it has to read the same twice in a row
+  if (raw != lastraw) {
+    lastraw = raw;
+    return;
+  }
+  now = raw;
+  down = now & ~pressed;
+  up = pressed & ~now;
+  pressed = now;
+
+  if (displaymode < sizeof(gesturetable) / sizeof(gesture_t)) {
+    memcpy_P(&g, &gesturetable[displaymode], sizeof(gesture_t));
   } else {
-    last_buttonstate &= ~0x1;
-  }
-
-  if (! (PIND & _BV(BUTTON3))) {
-    // button3 is pressed
-    if (! (last_buttonstate & 0x4)) { // was not pressed before
-      delayms(10);                    // debounce
-      if (PIND & _BV(BUTTON3))        // filter out bounces
-	return;
-      buttonholdcounter = 2;          // see if we're press-and-holding
-      while (buttonholdcounter) {
-	if (PIND & _BV(BUTTON3)) {        // released
-	  tick();                         // make a noise
-	  last_buttonstate &= ~0x4;
-	  // check if we will snag this button press for snoozing
-	  if (alarming) {
-	    // turn on snooze
-	    setsnooze();
-	    return;
-	  }
-	  DEBUGP("b3");
-	  just_pressed |= 0x4;
-	  return;
-	}
-      }
-      last_buttonstate |= 0x4;
-      pressed |= 0x4;                 // held down
+    memset(&g, 0, sizeof(gesture_t));
+  }
+  defer = g.longp | g.dbl | g.chord;
+
+  if (down) {
+    tick();                       // make a noise
+    // check if we will snag this button press for snoozing
+    if (alarming) {
+      setsnooze();
+      swallowed |= now;
+      return;
+    }
+    // more than one chord button down at once
+    if ((now & g.chord) == g.chord && (down & g.chord)) {
+      event_push(EV_CHORD | g.chord);
+      swallowed |= g.chord;
     }
-  } else {
-    pressed = 0;                      // button released
-    last_buttonstate &= ~0x4;
   }
-}
 
-// Just button #2
-SIGNAL(SIG_PIN_CHANGE0) {
-  sei();
-  if (! (PINB & _BV(BUTTON2))) {
-    // button2 is pressed
-    if (! (last_buttonstate & 0x2)) { // was not pressed before
-      delayms(10);                    // debounce
-      if (PINB & _BV(BUTTON2))        // filter out bounces
-	return;
-      tick();                         // make a noise
-      // check if we will snag this button press for snoozing
-      if (alarming) {
-	setsnooze(); 	// turn on snooze
-	return;
+  for (b = 0; b < 3; b++) {
+    bit = _BV(b);
+
+    if (swallowed & bit) {
+      if (! (now & bit))
+	swallowed &= ~bit;
+      btn_taps[b] = 0;
+      deferred &= ~bit;
+      continue;
+    }
+
+    if (down & bit) {
+      if (btn_taps[b]) {
+	// second press in time, that's a double
+	btn_taps[b] = 0;
+	event_push(EV_DOUBLE | bit);
+	swallowed |= bit;
+	continue;
+      }
+      if (defer & bit)
+	deferred |= bit;
+      else
+	event_push(EV_PRESS | bit);
+      btn_next[b] = (g.repeat & bit) ? BUTTON_REPEAT_DELAY : BUTTON_LONG;
+      btn_rate[b] = BUTTON_REPEAT_START;
+    } else if (now & bit) {
+      if (btn_next[b] && !--btn_next[b]) {
+	if (g.repeat & bit) {
+	  // auto-repeat, a little faster each time
+	  event_push(EV_REPEAT | bit);
+	  btn_next[b] = btn_rate[b];
+	  if (btn_rate[b] > BUTTON_REPEAT_MIN)
+	    btn_rate[b]--;
+	} else if (g.longp & bit) {
+	  event_push(EV_LONG | bit);
+	  swallowed |= bit;
+	  deferred &= ~bit;
+	}
       }
-      last_buttonstate |= 0x2;
-      just_pressed |= 0x2;
-      DEBUGP("b2");
+    } else if (up & bit) {
+      // only if the press was held back when it went down, the press
+      // could have changed displaymode (and so g) since
+      if (! (deferred & bit))
+	continue;
+      deferred &= ~bit;
+      if (g.dbl & bit)
+	btn_taps[b] = BUTTON_DOUBLE;  // wait and see if it's a double
+      else
+	event_push(EV_PRESS | bit);
+    } else if (btn_taps[b] && !--btn_taps[b]) {
+      // no second press came, it was just a press
+      event_push(EV_PRESS | bit);
     }
-  } else {
-    last_buttonstate &= ~0x2;
   }
 }
 
@@ -276,52 +526,71 @@ SIGNAL(SIG_PIN_CHANGE0) {
 // buttons in a few seconds, and turns off the menu display
 volatile uint8_t timeoutcounter = 0;
 
-// this goes off once a second
-SIGNAL (TIMER2_OVF_vect) {
-  CLKPR = _BV(CLKPCE);  //MEME
-  CLKPR = 0;
+// Seconds the RTC has counted since we started, for timing things
+// that go on for days
+volatile uint32_t rtc_uptime = 0;
+
+// How many seconds each timer 2 overflow is worth. Normally 1, but on
+// battery we slow the RTC down so it only wakes us every RTC_SLEEP_STEP
+volatile uint8_t rtc_step = 1;
+
+// No crystal is exactly 32768Hz, rtc_trim says how far off ours is in
+// 1/100ths of a ppm (+ when its slow). Each overflow adds its share
+// (rtc_trimstep, which is rtc_trim * rtc_step) to rtc_trimacc and once
+// that comes to a whole second we put in an extra second, or leave
+// one out
+int16_t rtc_trim = 0;
+int32_t rtc_trimstep = 0;
+int32_t rtc_trimacc = 0;
+
+// set the trim, and keep it for next time
+void rtc_settrim(int16_t trim) {
+  uint8_t sreg = SREG;
+
+  cli();
+  rtc_trim = trim;
+  rtc_trimstep = (int32_t)trim * rtc_step;
+  SREG = sreg;
+  if ((int16_t)eeprom_read_word((uint16_t *)EE_TRIM) != trim)
+    eeprom_write_word((uint16_t *)EE_TRIM, trim);
+}
 
-  time_s++;             // one second has gone by
+// Move the clock and calendar forward by up to a minute's worth of seconds
+void rtc_advance(uint8_t secs) {
+  time_s += secs;       // some seconds have gone by
+  rtc_uptime += secs;
 
   // a minute!
   if (time_s >= 60) {
-    time_s = 0;
+    time_s -= 60;
     time_m++;
+    if (++clock_mow >= MINS_PER_WEEK)
+      clock_mow = 0;
   }
 
   // an hour...
   if (time_m >= 60) {
     time_m = 0;
     time_h++; 
-    // lets write the time to the EEPROM
-    eeprom_write_byte((uint8_t *)EE_HOUR, time_h);
-    eeprom_write_byte((uint8_t *)EE_MIN, time_m);
-  }
 
-  // a day....
-  if (time_h >= 24) {
-    time_h = 0;
-    date_d++;
-    eeprom_write_byte((uint8_t *)EE_DAY, date_d);
-  }
+    // a day....
+    if (time_h >= 24) {
+      time_h = 0;
+      date_d++;
+      eeprom_write_byte((uint8_t *)EE_DAY, date_d);
+    }
 
-  /*
-  if (! sleepmode) {
-    uart_putw_dec(time_h);
-    uart_putchar(':');
-    uart_putw_dec(time_m);
-    uart_putchar(':');
-    uart_putw_dec(time_s);
-    putstring_nl("");
+    // lets write the time to the EEPROM, now that the hour can't be 24.
+    // the minutes are nearly always 0 already, no need to wear them out
+    eeprom_write_byte((uint8_t *)EE_HOUR, time_h);
+    if (eeprom_read_byte((uint8_t *)EE_MIN) != time_m)
+      eeprom_write_byte((uint8_t *)EE_MIN, time_m);
   }
-  */
 
   // a full month!
-  // we check the leapyear and date to verify when its time to roll over months
-  if ((date_d > 31) ||
-      ((date_d == 31) && ((date_m == 4)||(date_m == 6)||(date_m == 9)||(date_m == 11))) ||
-      ((date_d == 30) && (date_m == 2)) ||
-      ((date_d == 29) && (date_m == 2) && !leapyear(2000+date_y))) {
+  // this also catches a day past the end of the month from the date
+  // menu (2/31 say), which goes on to the 1st of the next
+  if (date_d > monthdays(date_m, date_y)) {
     date_d = 1;
     date_m++;
     eeprom_write_byte((uint8_t *)EE_MONTH, date_m);
@@ -331,53 +600,95 @@ SIGNAL (TIMER2_OVF_vect) {
   if (date_m >= 13) {
     date_y++;
     date_m = 1;
+    if (date_y >= 100) {
+      // 2099 goes round to 2000, which didn't start on the same day
+      date_y = 0;
+      clock_sync();
+    }
     eeprom_write_byte((uint8_t *)EE_YEAR, date_y);
   }
-  
+}
+
+// this goes off once a second (every RTC_SLEEP_STEP seconds on battery)
+SIGNAL (TIMER2_OVF_vect) {
+  uint8_t secs = rtc_step;
+
+  CLKPR = _BV(CLKPCE);  //MEME
+  CLKPR = 0;
+
+  // trim for the crystal
+  rtc_trimacc += rtc_trimstep;
+  if (rtc_trimacc >= TRIM_SECOND) {
+    rtc_trimacc -= TRIM_SECOND;
+    secs++;
+  } else if (rtc_trimacc <= -TRIM_SECOND) {
+    rtc_trimacc += TRIM_SECOND;
+    secs--;
+  }
+
+  rtc_advance(secs);
+
+  // the next alarm is always worked out ahead of time so this is all the
+  // checking we need, however many alarms there are. we still move on
+  // to the next one when we're asleep
+  if (clock_mow == alarm_next) {
+    if (alarm_on && !sleepmode) {
+      DEBUGP("alarm on!");
+      alarming = 1;
+      snoozetimer = 0;
+    }
+    alarm_schedule();
+  }
+
+  /*
+  if (! sleepmode) {
+    uart_putw_dec(time_h);
+    uart_putchar(':');
+    uart_putw_dec(time_m);
+    uart_putchar(':');
+    uart_putw_dec(time_s);
+    putstring_nl("");
+  }
+  */
+
   // If we're in low power mode we should get out now since the display is off
+  // (and the watchdog is off too)
   if (sleepmode)
     return;
+
+  // feed the watchdog if everyone has been by since last time
+  if (checkins == CHECKIN_ALL) {
+    checkins = 0;
+    kickthedog();
+  }
    
 
   if (displaymode == SHOW_TIME) {
-    if (timeunknown && (time_s % 2)) {
-      display_str("        ");
-    } else {
-      display_time(time_h, time_m, time_s);
-    }
+    display_time(time_h, time_m, time_s);
+    // flash the time until someone sets it
+    display_attrs(0, timeunknown ? 0xFF : 0);
     if (alarm_on)
       display[0] |= 0x2;
     else 
       display[0] &= ~0x2;
     
   }
-  if (alarm_on && (alarm_h == time_h) && (alarm_m == time_m) && (time_s == 0)) {
-    DEBUGP("alarm on!");
-    alarming = 1;
-    snoozetimer = 0;
-  }
-
   dimmer_update();
 
   if (timeoutcounter)
     timeoutcounter--;
-  if (buttonholdcounter)
-    buttonholdcounter--;
-  if (snoozetimer) {
+  if (snoozetimer)
     snoozetimer--;
-    if (snoozetimer % 2) 
-      display[0] |= 0x2;
-    else
-      display[0] &= ~0x2;
-  }
+  // the alarm indicator blinks while we're snoozing
+  blink[0] = snoozetimer ? 0x2 : 0;
 }
 
 SIGNAL(SIG_INTERRUPT0) {
   uart_putchar('i');
-  uint8_t x = ALARM_PIN & _BV(ALARM);
+  uint8_t x = pin_read(ALARM);
   sei();
   delayms(10); // wait for debouncing
-  if (x != (ALARM_PIN & _BV(ALARM)))
+  if (x != pin_read(ALARM))
     return;
   setalarmstate();
 }
@@ -389,29 +700,34 @@ SIGNAL(SIG_COMPARATOR) {
   if (ACSR & _BV(ACO)) {
     //DEBUGP("HIGH");
     if (!sleepmode) {
-      VFDSWITCH_PORT |= _BV(VFDSWITCH); // turn off display
-      VFDCLK_PORT &= ~_BV(VFDCLK) & ~_BV(VFDDATA); // no power to vfdchip
-      BOOST_PORT &= ~_BV(BOOST); // pull boost fet low
-      SPCR  &= ~_BV(SPE); // turn off spi
-      if (restored) {
-	eeprom_write_byte((uint8_t *)EE_MIN, time_m);
-	eeprom_write_byte((uint8_t *)EE_SEC, time_s);
-      }
-      DEBUGP("z");
+      // The supply is going away, so shed the big loads before anything
+      // else. No debug output in here, we don't have the time
+      TCCR0A = 0; // disconnect the boost pwm from the pin
       TCCR0B = 0; // no boost
+      pin_low(BOOST); // pull boost fet low
+      pin_high(VFDSWITCH); // turn off display
+      TCCR1B = 0; // no buzzer
+      pin_low(SPK1);
+      pin_low(SPK2);
+      pin_low(VFDCLK); // no power to vfdchip
+      pin_low(VFDDATA);
+      SPCR  &= ~_BV(SPE); // turn off spi
+      pin_low(DIMMER_POWER); // no power to photoresistor
       volume = 0; // low power buzzer
       PCICR = 0;  // ignore buttons
-      DIMMER_POWER_PORT &= ~_BV(DIMMER_POWER_PIN); // no power to photoresistor
+
+      if (restored)
+	pf_save();
 
       app_start();
     }
   } else {
     //DEBUGP("LOW");
     if (sleepmode) {
-      if (restored) {
-	eeprom_write_byte((uint8_t *)EE_MIN, time_m);
-	eeprom_write_byte((uint8_t *)EE_SEC, time_s);
-      }
+      rtc_setrate(1);  // count the seconds since the last RTC wakeup
+      if (restored)
+	pf_save();
+      power_set(POWER_RUN); // the uart is gated while we sleep
       DEBUGP("WAKERESET"); 
       app_start();
     }
@@ -420,127 +736,114 @@ SIGNAL(SIG_COMPARATOR) {
 
 /*********************** Main app **********/
 
-uint32_t t;
-
 void gotosleep(void) {
   // battery
-  //if (sleepmode) //already asleep?
-  //  return;
-  //DEBUGP("sleeptime");
-  
-  sleepmode = 1;
-  VFDSWITCH_PORT |= _BV(VFDSWITCH); // turn off display
-  SPCR  &= ~_BV(SPE); // turn off spi
-  VFDCLK_PORT &= ~_BV(VFDCLK) & ~_BV(VFDDATA); // no power to vfdchip
-  BOOST_PORT &= ~_BV(BOOST); // pull boost fet low
-  TCCR0B = 0; // no boost
-  volume = 0; // low power buzzer
-  PCICR = 0;  // ignore buttons
-  DIMMER_POWER_PORT &= ~_BV(DIMMER_POWER_PIN); // no power to photoresistor
-
-  // sleep time!
-  //beep(3520, 1);
-  //beep(1760, 1);
-  //beep(880, 1);
-  // turn beeper off
-  PORTB &= ~_BV(SPK1) & ~_BV(SPK2); 
-  
-  // turn off pullups
-  PORTD &= ~_BV(BUTTON1) & ~_BV(BUTTON3);
-  PORTB &= ~_BV(BUTTON2);
-  DDRD &= ~_BV(BUTTON1) & ~_BV(BUTTON3);
-  DDRB &= ~_BV(BUTTON2);
-  ALARM_PORT &= ~_BV(ALARM);
-  ALARM_DDR &= ~_BV(ALARM);
+  // we come back here after every RTC wakeup, only shut things
+  // down the first time through
+  if (!sleepmode) {
+    sleepmode = 1;
+    pin_high(VFDSWITCH); // turn off display
+    SPCR  &= ~_BV(SPE); // turn off spi
+    pin_low(VFDCLK); // no power to vfdchip
+    pin_low(VFDDATA);
+    pin_low(BOOST); // pull boost fet low
+    TCCR0B = 0; // no boost
+    volume = 0; // low power buzzer
+    PCICR = 0;  // ignore buttons
+    pin_low(DIMMER_POWER); // no power to photoresistor
+
+    // sleep time!
+    //beep(TONE(3520), 1);
+    //beep(TONE(1760), 1);
+    //beep(TONE(880), 1);
+    // turn beeper off
+    pin_low(SPK1);
+    pin_low(SPK2);
   
+    // turn off pullups
+    pin_low(BUTTON1);
+    pin_low(BUTTON2);
+    pin_low(BUTTON3);
+    pin_input(BUTTON1);
+    pin_input(BUTTON2);
+    pin_input(BUTTON3);
+    pin_low(ALARM);
+    pin_input(ALARM);
+
+    // gate the clocks to everything but the RTC and comparator
+    power_set(POWER_BATTERY);
+
+    // only wake up every few seconds, the watchdog can't wait that
+    // long so it goes off until main() starts over
+    wdt_disable();
+    rtc_setrate(RTC_SLEEP_STEP);
+  }
 
   // reduce the clock speed
   CLKPR = _BV(CLKPCE);
   CLKPR = _BV(CLKPS3);
   
-  //  PPR |= _BV(PRUSART0) | _BV(PRADC) | _BV(PRSPI) | _BV(PRTIM1) | _BV(PRTIM0) | _BV(PRTWI);
-  PORTC |= _BV(4);  // sleep signal
   SMCR |= _BV(SM1) | _BV(SM0) | _BV(SE); // sleep mode
   asm("sleep"); 
   CLKPR = _BV(CLKPCE);
   CLKPR = 0;
-  PORTC &= ~_BV(4);
 }
- 
- void wakeup(void) {
-   if (!sleepmode)
-     return;
-   CLKPR = _BV(CLKPCE);
-   CLKPR = 0;
-   DEBUGP("waketime");
-   sleepmode = 0;
-   // plugged in
-   // wait to verify
-   _delay_ms(20);
-   if (ACSR & _BV(ACO)) 
-     return;
-   
-   // turn on pullups
-   initbuttons();
-
-   dimmer_init();
-
-   // turn on boost
-   brightness_level = eeprom_read_byte((uint8_t *)EE_BRIGHT);
-   boost_init(brightness_level);
-
-   // turn on vfd control
-   vfd_init();
-
-   // turn on display
-   VFDSWITCH_PORT &= ~_BV(VFDSWITCH); 
-   VFDBLANK_PORT &= ~_BV(VFDBLANK);
-   volume = eeprom_read_byte((uint8_t *)EE_VOLUME); // reset
-   
-   speaker_init();
-
-   kickthedog();
-
-   setalarmstate();
-
-   // wake up sound
-   beep(880, 1);
-   beep(1760, 1);
-   beep(3520, 1);
-
-   kickthedog();
- }
 
+// only touches our own pins, whole port writes would undo the uart's
+// and the photocell's
 void initbuttons(void) {
-    DDRB =  _BV(VFDCLK) | _BV(VFDDATA) | _BV(SPK1) | _BV(SPK2);
-    DDRD = _BV(BOOST) | _BV(VFDSWITCH);
-    DDRC = _BV(VFDLOAD) | _BV(VFDBLANK);
-    PORTD = _BV(BUTTON1) | _BV(BUTTON3) | _BV(ALARM);
-    PORTB = _BV(BUTTON2);
-
-    PCICR = _BV(PCIE0) | _BV(PCIE2);
-    PCMSK0 = _BV(PCINT0);
-    PCMSK2 = _BV(PCINT21) | _BV(PCINT20);    
+    pin_low(VFDCLK);
+    pin_low(VFDDATA);
+    pin_low(SPK1);
+    pin_low(SPK2);
+    pin_low(BOOST);
+    pin_output(VFDCLK);
+    pin_output(VFDDATA);
+    pin_output(SPK1);
+    pin_output(SPK2);
+    pin_output(BOOST);
+    pin_output(VFDSWITCH);
+    pin_output(VFDLOAD);
+    pin_output(VFDBLANK);
+
+    // pullups on the buttons and alarm switch
+    pin_input(BUTTON1);
+    pin_input(BUTTON2);
+    pin_input(BUTTON3);
+    pin_input(ALARM);
+    pin_high(BUTTON1);
+    pin_high(BUTTON2);
+    pin_high(BUTTON3);
+    pin_high(ALARM);
+    // the buttons are polled by buttons_scan(), no pin change interrupts
 }
 
 int main(void) {
   //  uint8_t i;
-  uint8_t mcustate;
+  uint8_t what = 0, menu = 0, battery = 0;
+  input_event_t e;
 
   // turn boost off
   TCCR0B = 0;
-  BOOST_DDR |= _BV(BOOST);
-  BOOST_PORT &= ~_BV(BOOST); // pull boost fet low
-
-  // check if we were reset
-  mcustate = MCUSR;
+  pin_output(BOOST);
+  pin_low(BOOST); // pull boost fet low
+
+  // app_start() doesn't reset the peripherals, so ungate them all
+  power_set(POWER_RUN);
+  // or stop the RTC, which would tick the zeroed time up and show it
+  // before clock_init() has loaded the real one
+  TIMSK2 = 0;
+  TIFR2 = _BV(TOV2);
+
+  // we don't look at why we were reset, but a watchdog reset leaves
+  // WDRF set and that keeps the watchdog on until it's cleared
   MCUSR = 0;
 
   wdt_disable();
-  // now turn it back on... 2 second time out
+  // now turn it back on, see checkin()
   //WDTCSR |= _BV(WDP0) | _BV(WDP1) | _BV(WDP2);
   //WDTCSR = _BV(WDE);
-  wdt_enable(WDTO_2S);
+  wdt_enable(WDT_TIMEOUT);
   kickthedog();
 
   // we lost power at some point so lets alert the user
@@ -550,8 +853,8 @@ int main(void) {
   // have we read the time & date from eeprom?
   restored = 0;
 
-  // setup uart
-  uart_init(BRRL_192);
+  // setup uart, for debugging and setting up the clock
+  serial_init();
   //DEBUGP("VFD Clock");
   DEBUGP("!");
 
@@ -562,6 +865,7 @@ int main(void) {
   if (ACSR & _BV(ACO)) {
     // hmm we should not interrupt here
     ACSR |= _BV(ACI);
+    battery = 1;
 
     // even in low power mode, we run the clock 
     DEBUGP("clock init");
@@ -573,7 +877,7 @@ int main(void) {
     // init io's
     initbuttons();
     
-    VFDSWITCH_PORT &= ~_BV(VFDSWITCH);
+    pin_low(VFDSWITCH);
     
     DEBUGP("turning on buttons");
     // set up button interrupts
@@ -598,621 +902,396 @@ int main(void) {
     DEBUGP("speaker init");
     speaker_init();
 
-    beep(4000, 1);
+    beep_tune(tune_beep);
 
     DEBUGP("clock init");
     clock_init();  
 
+    // put the time up now rather than at the next RTC tick
+    display_time(time_h, time_m, time_s);
+
     DEBUGP("alarm init");
     setalarmstate();
   }
   DEBUGP("done");
   while (1) {
     //_delay_ms(100);
-    kickthedog();
+    checkin(CHECKIN_MAIN);
+    status_service();
+    serial_service();
+    nmea_service();
     //uart_putc_hex(ACSR);
     if (ACSR & _BV(ACO)) {
       // DEBUGP("SLEEPYTIME");
       gotosleep();
       continue;
     }
+    // the mains came back before we got to sleep, so nothing woke us
+    // up and the display was never set up. start over
+    if (battery)
+      app_start();
     //DEBUGP(".");
-    if (just_pressed & 0x1) {
-      just_pressed = 0;
-      switch(displaymode) {
-      case (SHOW_TIME):
-	displaymode = SET_ALARM;
-	display_str("set alarm");
-	set_alarm();
-	break;
-      case (SET_ALARM):
-	displaymode = SET_TIME;
-	display_str("set time");
-	set_time();
-	timeunknown = 0;
-	break;
-      case (SET_TIME):
-	displaymode = SET_DATE;
-	display_str("set date");
-	set_date();
-	break;
-      case (SET_DATE):
-	displaymode = SET_BRIGHTNESS;
-	display_str("set brit");
-	set_brightness();
-	break;
-      case (SET_BRIGHTNESS):
-	displaymode = SET_DIMMER;
-	display_str("set dimr");
-	set_dimmer();
-	break;
-      case (SET_DIMMER):
-	displaymode = SET_VOLUME;
-	display_str("set vol ");
-	set_volume();
-	break;
-      case (SET_VOLUME):
-	displaymode = SET_REGION;
-	display_str("set regn");
-	set_region();
-	break;
-	/*
-      case (SET_REGION):
-	displaymode = SET_SNOOZE;
-	display_str("set snoz");
-	set_snooze();
-	break;
-	*/
-      default:
-	displaymode = SHOW_TIME;
-      }
-    } else if ((just_pressed & 0x2) || (just_pressed & 0x4)) {
-      just_pressed = 0;
-      displaymode = NONE;
-      display_date(DAY);
-
-      kickthedog();
-      delayms(1500);
-      kickthedog();
 
-      displaymode = SHOW_TIME;     
-    } 
-  }
-}
-
-/**************************** SUB-MENUS *****************************/
-
-void set_alarm(void) 
-{
-  uint8_t mode;
-  uint8_t hour, min, sec;
-    
-  hour = min = sec = 0;
-  mode = SHOW_MENU;
-
-  hour = alarm_h;
-  min = alarm_m;
-  sec = 0;
-  
-  timeoutcounter = INACTIVITYTIMEOUT;
-  
-  while (1) {
-    if (just_pressed & 0x1) { // mode change
-      return;
-    }
-    if (just_pressed || pressed) {
-      timeoutcounter = INACTIVITYTIMEOUT;  
-      // timeout w/no buttons pressed after 3 seconds?
-    } else if (!timeoutcounter) {
-      //timed out!
-      displaymode = SHOW_TIME;     
-      alarm_h = hour;
-      alarm_m = min;
-      eeprom_write_byte((uint8_t *)EE_ALARM_HOUR, alarm_h);    
-      eeprom_write_byte((uint8_t *)EE_ALARM_MIN, alarm_m);    
-      return;
-    }
-    if (just_pressed & 0x2) {
-      just_pressed = 0;
-      if (mode == SHOW_MENU) {
-	// ok now its selected
-	mode = SET_HOUR;
-	display_alarm(hour, min);
-	display[1] |= 0x1;
-	display[2] |= 0x1;	
-      } else if (mode == SET_HOUR) {
-	mode = SET_MIN;
-	display_alarm(hour, min);
-	display[4] |= 0x1;
-	display[5] |= 0x1;
-      } else {
-	// done!
-	alarm_h = hour;
-	alarm_m = min;
-	eeprom_write_byte((uint8_t *)EE_ALARM_HOUR, alarm_h);    
-	eeprom_write_byte((uint8_t *)EE_ALARM_MIN, alarm_m);    
-	displaymode = SHOW_TIME;
-	return;
-      }
+    // handle the next button event, a menu may hand us back the one
+    // that got it to quit
+    if (!what) {
+      if (!event_pop(&e))
+	continue;
+      what = e.what;
     }
-    if ((just_pressed & 0x4) || (pressed & 0x4)) {
-      just_pressed = 0;
-
-      if (mode == SET_HOUR) {
-	hour = (hour+1) % 24;
-	display_alarm(hour, min);
-	display[1] |= 0x1;
-	display[2] |= 0x1;
-      }
-      if (mode == SET_MIN) {
-	min = (min+1) % 60;
-	display_alarm(hour, min);
-	display[4] |= 0x1;
-	display[5] |= 0x1;
-      }
 
-      if (pressed & 0x4)
-	delayms(75);
-    }
-  }
-}
-
-void set_time(void) 
-{
-  uint8_t mode;
-  uint8_t hour, min, sec;
-    
-  hour = time_h;
-  min = time_m;
-  sec = time_s;
-  mode = SHOW_MENU;
-
-  timeoutcounter = INACTIVITYTIMEOUT;
-  
-  while (1) {
-    if (just_pressed & 0x1) { // mode change
-      return;
-    }
-    if (just_pressed || pressed) {
-      timeoutcounter = INACTIVITYTIMEOUT;  
-      // timeout w/no buttons pressed after 3 seconds?
-    } else if (!timeoutcounter) {
-      //timed out!
-      displaymode = SHOW_TIME;     
-      return;
-    }
-    if (just_pressed & 0x2) {
-      just_pressed = 0;
-      if (mode == SHOW_MENU) {
-	hour = time_h;
-	min = time_m;
-	sec = time_s;
-
-	// ok now its selected
-	mode = SET_HOUR;
-	display_time(hour, min, sec);
-	display[1] |= 0x1;
-	display[2] |= 0x1;	
-      } else if (mode == SET_HOUR) {
-	mode = SET_MIN;
-	display_time(hour, min, sec);
-	display[4] |= 0x1;
-	display[5] |= 0x1;
-      } else if (mode == SET_MIN) {
-	mode = SET_SEC;
-	display_time(hour, min, sec);
-	display[7] |= 0x1;
-	display[8] |= 0x1;
+    if (displaymode == SHOW_SCROLL) {
+      // any button cuts a message short
+      what = 0;
+      scroll_stop();
+    } else if (what == (EV_LONG | 0x1)) {
+      // holding the mode button gets us out of the menus
+      what = 0;
+      displaymode = SHOW_TIME;
+    } else if ((what == (EV_PRESS | 0x1)) || (what == (EV_DOUBLE | 0x1))) {
+      if (displaymode == SHOW_TIME) {
+	// a double press skips past the alarm to setting the time
+	menu = (what == (EV_DOUBLE | 0x1)) ? 1 : 0;
+      } else if ((menu < MENUS) &&
+		 (displaymode == pgm_read_byte(&menutable[menu].mode))) {
+	// on to the next menu
+	menu++;
       } else {
-	// done!
-	time_h = hour;
-	time_m = min;
-	time_s = sec;
-	displaymode = SHOW_TIME;
-	return;
+	menu = MENUS;
       }
-    }
-    if ((just_pressed & 0x4) || (pressed & 0x4)) {
-      just_pressed = 0;
-      
-      if (mode == SET_HOUR) {
-	hour = (hour+1) % 24;
-	display_time(hour, min, sec);
-	display[1] |= 0x1;
-	display[2] |= 0x1;
-	time_h = hour;
-	eeprom_write_byte((uint8_t *)EE_HOUR, time_h);    
-      }
-      if (mode == SET_MIN) {
-	min = (min+1) % 60;
-	display_time(hour, min, sec);
-	display[4] |= 0x1;
-	display[5] |= 0x1;
-	eeprom_write_byte((uint8_t *)EE_MIN, time_m);
-	time_m = min;
-      }
-      if ((mode == SET_SEC) ) {
-	sec = (sec+1) % 60;
-	display_time(hour, min, sec);
-	display[7] |= 0x1;
-	display[8] |= 0x1;
-	time_s = sec;
-      }
-      
-      if (pressed & 0x4)
-	delayms(75);
+      what = 0;
+      status_step = STATUS_NONE; // menus take over the display
+      if (menu < MENUS)
+	what = menu_run(menu);
+      else
+	displaymode = SHOW_TIME;
+    } else if (displaymode == SHOW_STOPWATCH) {
+      stopwatch_button(what);
+      what = 0;
+    } else if ((what == (EV_CHORD | 0x6)) && (displaymode == SHOW_TIME)) {
+      // buttons 2 & 3 together for the stopwatch
+      what = 0;
+      stopwatch_show();
+    } else if ((what == (EV_PRESS | 0x2)) || (what == (EV_PRESS | 0x4))) {
+      what = 0;
+      display_date(DAY);
+    } else {
+      what = 0;  // nothing for us
     }
   }
 }
 
+/**************************** SUB-MENUS *****************************/
 
+// Every setting menu works the same way: the title shows until button 2
+// picks the first field, button 3 steps the field, button 2 moves on to
+// the next one and after the last field it's done. Each menu is just a
+// descriptor in menutable below and menu_run() does the rest.
 
-void set_date(void) {
-  uint8_t mode = SHOW_MENU;
+// What each menu shows while a field is being set
+void menu_draw_alarm(uint8_t *v) {
+  display_alarm(v[0], v[1]);
+}
 
-  timeoutcounter = INACTIVITYTIMEOUT;;  
+void menu_draw_time(uint8_t *v) {
+  display_time(v[0], v[1], v[2]);
+}
 
-  while (1) {
-    if (just_pressed || pressed) {
-      timeoutcounter = INACTIVITYTIMEOUT;;  
-      // timeout w/no buttons pressed after 3 seconds?
-    } else if (!timeoutcounter) {
-      //timed out!
-      displaymode = SHOW_TIME;     
-      return;
-    }
-    if (just_pressed & 0x1) { // mode change
-      return;
-    }
-    if (just_pressed & 0x2) {
+void menu_draw_date(uint8_t *v) {
+  display_numdate(v[1], v[2], v[0]);
+}
 
-      just_pressed = 0;
-      if (mode == SHOW_MENU) {
-	// start!
-	if (region == REGION_US) {
-	  mode = SET_MONTH;
-	}
-	else {
-	  DEBUGP("Set day");
-	  mode = SET_DAY;
-	}
-	display_date(DATE);
-	display[1] |= 0x1;
-	display[2] |= 0x1;
-      } else if (((mode == SET_MONTH) && (region == REGION_US)) ||
-		 ((mode == SET_DAY) && (region == REGION_EU))) {
-	if (region == REGION_US)
-	  mode = SET_DAY;
-	else
-	  mode = SET_MONTH;
-	display_date(DATE);
-	display[4] |= 0x1;
-	display[5] |= 0x1;
-      } else if (((mode == SET_DAY) && (region == REGION_US)) ||
-	((mode == SET_MONTH) && (region == REGION_EU))) {
-	mode = SET_YEAR;
-	display_date(DATE);
-	display[7] |= 0x1;
-	display[8] |= 0x1;
-      } else {
-	displaymode = NONE;
-	display_date(DATE);
-	delayms(1500);
-	displaymode = SHOW_TIME;
-	return;
-      }
-    }
-    if ((just_pressed & 0x4) || (pressed & 0x4)) {
-      just_pressed = 0;
-      if (mode == SET_MONTH) {
-	date_m++;
-	if (date_m >= 13)
-	  date_m = 1;
-	display_date(DATE);
-	if (region == REGION_US) {
-	  display[1] |= 0x1;
-	  display[2] |= 0x1;
-	} else {
-	  display[4] |= 0x1;
-	  display[5] |= 0x1;
-	}
-	eeprom_write_byte((uint8_t *)EE_MONTH, date_m);    
-      }
-      if (mode == SET_DAY) {
-	date_d++;
-	if (date_d > 31)
-	  date_d = 1;
-	display_date(DATE);
-
-	if (region == REGION_EU) {
-	  display[1] |= 0x1;
-	  display[2] |= 0x1;
-	} else {
-	  display[4] |= 0x1;
-	  display[5] |= 0x1;
-	}
-	eeprom_write_byte((uint8_t *)EE_DAY, date_d);    
-      }
-      if (mode == SET_YEAR) {
-	date_y++;
-	date_y %= 100;
-	display_date(DATE);
-	display[7] |= 0x1;
-	display[8] |= 0x1;
-	eeprom_write_byte((uint8_t *)EE_YEAR, date_y);    
-      }
+void menu_draw_brightness(uint8_t *v) {
+  display_str("brite ");
+  display[7] = pgm_read_byte(numbertable_p + (v[0] / 10));
+  display[8] = pgm_read_byte(numbertable_p + (v[0] % 10));
+}
 
-      if (pressed & 0x4)
-	delayms(60);
-    }
+void menu_draw_dimmer(uint8_t *v) {
+  if (v[0]) {
+    display_str("dimr on ");
+  } else {
+    display_str("dimr off");
   }
 }
 
+void menu_draw_volume(uint8_t *v) {
+  if (v[0]) {
+    display_str("vol high");
+    display[5] |= 0x1;
+  } else {
+    display_str("vol  low");
+  }
+  display[6] |= 0x1;
+  display[7] |= 0x1;
+  display[8] |= 0x1;
+}
 
-void set_brightness(void) {
-  uint8_t mode = SHOW_MENU;
-
-  timeoutcounter = INACTIVITYTIMEOUT;;  
-
-  while (1) {
-    if (just_pressed || pressed) {
-      timeoutcounter = INACTIVITYTIMEOUT;;  
-      // timeout w/no buttons pressed after 3 seconds?
-    } else if (!timeoutcounter) {
-      //timed out!
-      displaymode = SHOW_TIME;     
-      eeprom_write_byte((uint8_t *)EE_BRIGHT, brightness_level);
-      return;
-    }
-    if (just_pressed & 0x1) { // mode change
-      return;
-    }
-    if (just_pressed & 0x2) {
-
-      just_pressed = 0;
-      if (mode == SHOW_MENU) {
-	// start!
-	mode = SET_BRITE;
-	// display brightness
-        set_vfd_brightness(brightness_level);
-	display_str("brite ");
-	display[7] = pgm_read_byte(numbertable_p + (brightness_level / 10)) | 0x1;
-	display[8] = pgm_read_byte(numbertable_p + (brightness_level % 10)) | 0x1;
-      } else {	
-	displaymode = SHOW_TIME;
-	eeprom_write_byte((uint8_t *)EE_BRIGHT, brightness_level);
-	return;
-      }
-    }
-    if ((just_pressed & 0x4) || (pressed & 0x4)) {
-      just_pressed = 0;
-      if (mode == SET_BRITE) {
-	brightness_level += BRIGHTNESS_INCREMENT;
-	if (brightness_level > BRIGHTNESS_MAX)
-	  brightness_level = BRIGHTNESS_MIN;
-	display[7] = pgm_read_byte(numbertable_p + (brightness_level / 10)) | 0x1;
-	display[8] = pgm_read_byte(numbertable_p + (brightness_level % 10)) | 0x1;
-        set_vfd_brightness(brightness_level);
-      }
-    }
+void menu_draw_region(uint8_t *v) {
+  if (v[0] == REGION_US) {
+    display_str("usa-12hr");
+  } else {
+    display_str("eur-24hr");
   }
 }
 
-void set_dimmer(void) {
-  uint8_t mode = SHOW_MENU;
+void menu_draw_snooze(uint8_t *v) {
+  display_str("   minut");
+  display[1] = pgm_read_byte(numbertable_p + (v[0] / 10));
+  display[2] = pgm_read_byte(numbertable_p + (v[0] % 10));
+}
 
-  timeoutcounter = INACTIVITYTIMEOUT;;  
+// Some settings take effect while you're still changing them
+void menu_change_brightness(uint8_t *v) {
+  set_vfd_brightness(v[0]);
+}
 
-  while (1) {
-    if (just_pressed || pressed) {
-      timeoutcounter = INACTIVITYTIMEOUT;;  
-      // timeout w/no buttons pressed after 3 seconds?
-    } else if (!timeoutcounter) {
-      //timed out!
-      displaymode = SHOW_TIME;     
-      return;
-    }
-    if (just_pressed & 0x1) { // mode change
-      return;
-    }
-    if (just_pressed & 0x2) {
-      just_pressed = 0;
-      if (mode == SHOW_MENU) {
-	// start!
-	mode = SET_DIMMER;
-	if (dimmer_on) {
-	  display_str("dimr on ");
-	} else {
-	  display_str("dimr off");
-	}
-      } else {	
-	displaymode = SHOW_TIME;
-	return;
-      }
-    }
-    if (just_pressed & 0x4) {
-      just_pressed = 0;
-      if (mode == SET_DIMMER) {
-	dimmer_on = !dimmer_on;
-	if (dimmer_on) {
-	  display_str("dimr on ");
-          dimmer_update();
-	} else {
-	  display_str("dimr off");
-          set_vfd_brightness(brightness_level);
-	}
-	eeprom_write_byte((uint8_t *)EE_DIMMER, dimmer_on);
-      }
-    }
+void menu_change_dimmer(uint8_t *v) {
+  dimmer_on = v[0];
+  if (dimmer_on) {
+    dimmer_update();
+  } else {
+    set_vfd_brightness(brightness_level);
   }
 }
 
-void set_volume(void) {
-  uint8_t mode = SHOW_MENU;
-  uint8_t volume;
+void menu_change_volume(uint8_t *v) {
+  // speaker_init() takes the volume from EEPROM
+  eeprom_write_byte((uint8_t *)EE_VOLUME, v[0]);
+  speaker_init();
+  beep_tune(tune_beep);
+}
 
-  timeoutcounter = INACTIVITYTIMEOUT;;  
-  volume = eeprom_read_byte((uint8_t *)EE_VOLUME);
+void menu_saved_time(void) {
+  timeunknown = 0;
+  clock_sync();
+}
+
+const menu_t menutable[] PROGMEM = {
+  { SET_ALARM, "set alarm", menu_draw_alarm, 0, alarm_schedule, EE_ALARMS, 0, 2, {
+      { &alarms[0].h, 0, 23, 1, 1 },
+      { &alarms[0].m, 0, 59, 1, 4 } } },
+  { SET_TIME, "set time", menu_draw_time, 0, menu_saved_time, EE_HOUR, 0, 3, {
+      { &time_h, 0, 23, 1, 1 },
+      { &time_m, 0, 59, 1, 4 },
+      { &time_s, 0, 59, 1, 7 } } },
+  { SET_DATE, "set date", menu_draw_date, 0, clock_sync, EE_YEAR, MENU_HOLD, 3, {
+      { &date_y, 0, 99, 1, 7 },
+      { &date_m, 1, 12, 1, 1 | MENU_POS_REGION },
+      { &date_d, 1, 31, 1, 4 | MENU_POS_REGION } } },
+  { SET_BRIGHTNESS, "set brit", menu_draw_brightness, menu_change_brightness, 0,
+    EE_BRIGHT, 0, 1, {
+      { &brightness_level, BRIGHTNESS_MIN, BRIGHTNESS_MAX, BRIGHTNESS_INCREMENT, 7 } } },
+  { SET_DIMMER, "set dimr", menu_draw_dimmer, menu_change_dimmer, 0, EE_DIMMER, 0, 1, {
+      { &dimmer_on, 0, 1, 1, 0 } } },
+  { SET_VOLUME, "set vol ", menu_draw_volume, menu_change_volume, 0, EE_VOLUME, 0, 1, {
+      { &volume, 0, 1, 1, 0 } } },
+  { SET_REGION, "set regn", menu_draw_region, 0, 0, EE_REGION, 0, 1, {
+      { &region, 0, 1, 1, 0 } } },
+  // to let people pick the snooze time, add this (bump MENUS, and have
+  // setsnooze() read EE_SNOOZE)
+  /*
+  { SET_SNOOZE, "set snoz", menu_draw_snooze, 0, 0, EE_SNOOZE, 0, 1, {
+      { 0, 0, 99, 1, 1 } } },
+  */
+};
+
+// won't build if MENUS doesn't match the table
+typedef char menus_check[(sizeof(menutable) / sizeof(menu_t) == MENUS) ? 1 : -1];
+
+// Wait for the next button event in a menu. Returns 0 once there have
+// been no buttons pressed for INACTIVITYTIMEOUT seconds
+uint8_t menu_wait(void) {
+  input_event_t e;
 
   while (1) {
-    if (just_pressed || pressed) {
-      timeoutcounter = INACTIVITYTIMEOUT;;  
-      // timeout w/no buttons pressed after 3 seconds?
-    } else if (!timeoutcounter) {
-      //timed out!
-      displaymode = SHOW_TIME;     
-      return;
-    }
-    if (just_pressed & 0x1) { // mode change
-      return;
-    }
-    if (just_pressed & 0x2) {
-      just_pressed = 0;
-      if (mode == SHOW_MENU) {
-	// start!
-	mode = SET_VOL;
-	// display volume
-	if (volume) {
-	  display_str("vol high");
-	  display[5] |= 0x1;
-	} else {
-	  display_str("vol  low");
-	}
-	display[6] |= 0x1;
-	display[7] |= 0x1;
-	display[8] |= 0x1;
-      } else {	
-	displaymode = SHOW_TIME;
-	return;
-      }
-    }
-    if (just_pressed & 0x4) {
-      just_pressed = 0;
-      if (mode == SET_VOL) {
-	volume = !volume;
-	if (volume) {
-	  display_str("vol high");
-	  display[5] |= 0x1;
-	} else {
-	  display_str("vol  low");
-	}
-	display[6] |= 0x1;
-	display[7] |= 0x1;
-	display[8] |= 0x1;
-	eeprom_write_byte((uint8_t *)EE_VOLUME, volume);
-	speaker_init();
-	beep(4000, 1);
-      }
+    checkin(CHECKIN_MAIN);
+    if (event_pop(&e)) {
+      timeoutcounter = INACTIVITYTIMEOUT;
+      return e.what;
     }
+    if (pressed)
+      timeoutcounter = INACTIVITYTIMEOUT;
+    else if (!timeoutcounter)
+      return 0;
   }
 }
 
-void set_region(void) {
-  uint8_t mode = SHOW_MENU;
+// Where a field sits on the display. The date is mm-dd-yy in the US and
+// dd-mm-yy everywhere else so those two swap places
+uint8_t menu_pos(menufield_t *fd) {
+  uint8_t pos = fd->pos & ~MENU_POS_REGION;
 
-  timeoutcounter = INACTIVITYTIMEOUT;;  
-  region = eeprom_read_byte((uint8_t *)EE_REGION);
+  if ((fd->pos & MENU_POS_REGION) && (region == REGION_EU))
+    pos = (pos == 1) ? 4 : 1;
+  return pos;
+}
 
-  while (1) {
-    if (just_pressed || pressed) {
-      timeoutcounter = INACTIVITYTIMEOUT;;  
-      // timeout w/no buttons pressed after 3 seconds?
-    } else if (!timeoutcounter) {
-      //timed out!
-      displaymode = SHOW_TIME;     
-      return;
-    }
-    if (just_pressed & 0x1) { // mode change
-      return;
-    }
-    if (just_pressed & 0x2) {
-      just_pressed = 0;
-      if (mode == SHOW_MENU) {
-	// start!
-	mode = SET_REG;
-	// display region
-	if (region == REGION_US) {
-	  display_str("usa-12hr");
-	} else {
-	  display_str("eur-24hr");
-	}
-      } else {	
-	displaymode = SHOW_TIME;
-	return;
-      }
-    }
-    if (just_pressed & 0x4) {
-      just_pressed = 0;
-      if (mode == SET_REG) {
-	region = !region;
-	if (region == REGION_US) {
-	  display_str("usa-12hr");
-	} else {
-	  display_str("eur-24hr");
-	}
-	eeprom_write_byte((uint8_t *)EE_REGION, region);
-      }
-    }
+// Fields get set left to right, this finds the one after field f
+// (or the first one). Returns MENU_TITLE when there are no more
+uint8_t menu_nextfield(menu_t *m, uint8_t f) {
+  uint8_t i, pos, from, next = MENU_TITLE;
+
+  from = (f == MENU_TITLE) ? 0 : menu_pos(&m->field[f]) + 1;
+  for (i = 0; i < m->fields; i++) {
+    pos = menu_pos(&m->field[i]);
+    if ((pos >= from) && ((next == MENU_TITLE) || (pos < menu_pos(&m->field[next]))))
+      next = i;
   }
+  return next;
 }
 
+// Draw the values and dot the digits of the field being set
+void menu_draw(menu_t *m, uint8_t *v, uint8_t f) {
+  uint8_t pos;
 
-/*
-void set_snooze(void) {
-  uint8_t mode = SHOW_MENU;
-  uint8_t snooze;
+  m->draw(v);
+  display_attrs(0, 0);
+  pos = menu_pos(&m->field[f]);
+  if (pos) {
+    attr[pos] = ATTR_DOT;
+    attr[pos+1] = ATTR_DOT;
+  }
+}
+
+// Store the values that were changed (bit i of 'changed' for field i)
+// back where they came from, and in EEPROM. The others are left alone,
+// the clock has kept going while we were in the menu and the minutes
+// we snapshotted on the way in are stale by now
+void menu_save(menu_t *m, uint8_t *v, uint8_t changed) {
+  uint8_t i, sreg;
+  uint8_t *ee;
+
+  sreg = SREG;
+  cli();  // so the RTC doesn't tick half way through setting the time
+  for (i = 0; i < m->fields; i++)
+    if (m->field[i].var && (changed & _BV(i)))
+      *m->field[i].var = v[i];
+  SREG = sreg;
+
+  for (i = 0; i < m->fields; i++) {
+    if (!(changed & _BV(i)))
+      continue;
+    ee = (uint8_t *)(uintptr_t)(m->ee + i);
+    if (eeprom_read_byte(ee) != v[i])
+      eeprom_write_byte(ee, v[i]);
+  }
+  if (m->saved)
+    m->saved();
+}
+
+// Run menu n. Returns the mode button event that made us leave, or 0
+// if the menu finished or timed out
+uint8_t menu_run(uint8_t n) {
+  menu_t m;
+  menufield_t *fd;
+  uint8_t v[MENU_FIELDS];
+  uint8_t i, what, f = MENU_TITLE, changed = 0;
+
+  memcpy_P(&m, &menutable[n], sizeof(menu_t));
+  displaymode = m.mode;
+  display_str(m.title);
 
-  timeoutcounter = INACTIVITYTIMEOUT;;  
-  snooze = eeprom_read_byte((uint8_t *)EE_SNOOZE);
+  timeoutcounter = INACTIVITYTIMEOUT;
 
   while (1) {
-    if (just_pressed || pressed) {
-      timeoutcounter = INACTIVITYTIMEOUT;;  
-      // timeout w/no buttons pressed after 3 seconds?
-    } else if (!timeoutcounter) {
-      //timed out!
-      displaymode = SHOW_TIME;     
-      return;
-    }
-    if (just_pressed & 0x1) { // mode change
-      return;
-    }
-    if (just_pressed & 0x2) {
-
-      just_pressed = 0;
-      if (mode == SHOW_MENU) {
-	// start!
-	mode = SET_SNOOZE;
-	// display snooze
-	display_str("   minut");
-	display[1] = pgm_read_byte(numbertable_p + (snooze / 10)) | 0x1;
-	display[2] = pgm_read_byte(numbertable_p + (snooze % 10)) | 0x1;
-      } else { 
+    what = menu_wait();
+    if (!what || (EV_BUTTONS(what) & 0x1)) {
+      // timed out, or off to the next menu. keep what was changed
+      if (changed)
+	menu_save(&m, v, changed);
+      if (!what)
 	displaymode = SHOW_TIME;
-	return;
-      }
+      return what;
     }
-    if ((just_pressed & 0x4) || (pressed & 0x4)) {
-      just_pressed = 0;
-      if (mode == SET_SNOOZE) {
-        snooze ++;
-	if (snooze >= 100)
-	  snooze = 0;
-	display[1] = pgm_read_byte(numbertable_p + (snooze / 10)) | 0x1;
-	display[2] = pgm_read_byte(numbertable_p + (snooze % 10)) | 0x1;
-	eeprom_write_byte((uint8_t *)EE_SNOOZE, snooze);
-      }
-
-      if (pressed & 0x4)
-	delayms(75);
 
+    if (what == (EV_PRESS | 0x2)) {
+      if (f == MENU_TITLE) {
+	// ok now its selected, start from the current settings
+	for (i = 0; i < m.fields; i++) {
+	  fd = &m.field[i];
+	  if (fd->var)
+	    v[i] = *fd->var;
+	  else
+	    v[i] = eeprom_read_byte((uint8_t *)(uintptr_t)(m.ee + i));
+	  if ((v[i] < fd->min) || (v[i] > fd->max))
+	    v[i] = fd->min;
+	}
+	f = menu_nextfield(&m, MENU_TITLE);
+      } else {
+	f = menu_nextfield(&m, f);
+	if (f == MENU_TITLE) {
+	  // done! (saved() still gets called if nothing changed, going
+	  // through the time is how you say it's right)
+	  menu_save(&m, v, changed);
+	  if (m.flags & MENU_HOLD) {
+	    // leave the result up for a moment
+	    m.draw(v);
+	    displaymode = NONE;
+	    status_show(STATUS_DONE, 1500);
+	  } else {
+	    displaymode = SHOW_TIME;
+	  }
+	  return 0;
+	}
+      }
+      menu_draw(&m, v, f);
+    } else if (EV_STEP(what, 0x4) && (f != MENU_TITLE)) {
+      fd = &m.field[f];
+      v[f] += fd->step;
+      if (v[f] > fd->max)
+	v[f] = fd->min;
+      changed |= _BV(f);
+      if (m.change)
+	m.change(v);
+      menu_draw(&m, v, f);
     }
   }
 }
-*/
 
 
 /**************************** RTC & ALARM *****************************/
+// Switch the RTC between 1 second and RTC_SLEEP_STEP second overflows
+// without losing the part of a second we're already into. At div 128
+// TCNT2 counts 1/256ths of a second, at div 1024 it counts 1/32ths
+void rtc_setrate(uint8_t step) {
+  uint8_t sreg = SREG;
+  uint8_t count;
+
+  if (step == rtc_step)
+    return;
+
+  cli();
+  // TCNT2 isn't valid for one crystal tick after a wakeup, so push a
+  // dummy write through the async registers first
+  OCR2A = 0;
+  while (ASSR & (_BV(OCR2AUB) | _BV(TCN2UB) | _BV(TCR2BUB)));
+
+  count = TCNT2;
+  if (TIFR2 & _BV(TOV2)) {
+    // it overflowed under us, count that at the old rate
+    TIFR2 = _BV(TOV2);
+    rtc_advance(rtc_step);
+    count = TCNT2;
+  }
+
+  if (step == RTC_SLEEP_STEP) {
+    TCCR2B = _BV(CS22) | _BV(CS21) | _BV(CS20); // div by 1024
+    TCNT2 = count / 8;
+  } else {
+    // catch up on the whole seconds since the last overflow
+    rtc_advance(count / 32);
+    TCCR2B = _BV(CS22) | _BV(CS20); // div by 128
+    TCNT2 = (count % 32) * 8;
+  }
+  rtc_step = step;
+  rtc_trimstep = (int32_t)rtc_trim * step;
+
+  // wait for it to take before anyone goes to sleep
+  while (ASSR & (_BV(TCN2UB) | _BV(TCR2BUB)));
+  SREG = sreg;
+}
+
 void clock_init(void) {
   // we store the time in EEPROM when switching from power modes so its
   // reasonable to start with whats in memory
@@ -1220,6 +1299,10 @@ void clock_init(void) {
   time_m = eeprom_read_byte((uint8_t *)EE_MIN) % 60;
   time_s = eeprom_read_byte((uint8_t *)EE_SEC) % 60;
 
+  // a power fail record is always newer than the above, fold it into
+  // the regular copy and get the slot ready for next time
+  pf_restore();
+
   /*
     // if you're debugging, having the makefile set the right
     // time automatically will be very handy. Otherwise don't use this
@@ -1228,14 +1311,17 @@ void clock_init(void) {
   time_s = TIMESEC + 10;
   */
 
-  // Set up the stored alarm time and date
-  alarm_m = eeprom_read_byte((uint8_t *)EE_ALARM_MIN) % 60;
-  alarm_h = eeprom_read_byte((uint8_t *)EE_ALARM_HOUR) % 24;
-
+  // Set up the stored date and alarm times
   date_y = eeprom_read_byte((uint8_t *)EE_YEAR) % 100;
   date_m = eeprom_read_byte((uint8_t *)EE_MONTH) % 13;
   date_d = eeprom_read_byte((uint8_t *)EE_DAY) % 32;
 
+  alarm_init();
+  clock_sync();
+  nmea_init();
+
+  rtc_settrim(eeprom_read_word((uint16_t *)EE_TRIM));
+
   restored = 1;
 
   // Turn on the RTC by selecting the external 32khz crystal
@@ -1251,10 +1337,76 @@ void clock_init(void) {
   sei();
 }
 
+// Read the alarm table from EEPROM. Clocks that only have the one old
+// style alarm get it copied in as alarm 0, going off every day
+void alarm_init(void) {
+  uint8_t i;
+  uint8_t *ee = (uint8_t *)EE_ALARMS;
+
+  if (eeprom_read_byte(ee) == 0xFF) {
+    eeprom_write_byte(ee, eeprom_read_byte((uint8_t *)EE_ALARM_HOUR) % 24);
+    eeprom_write_byte(ee+1, eeprom_read_byte((uint8_t *)EE_ALARM_MIN) % 60);
+    eeprom_write_byte(ee+2, ALARM_EVERYDAY);
+  }
+
+  for (i = 0; i < ALARMS; i++) {
+    alarms[i].h = eeprom_read_byte(ee++);
+    alarms[i].m = eeprom_read_byte(ee++);
+    alarms[i].days = eeprom_read_byte(ee++);
+  }
+}
+
+// Work out which alarm goes off next, and when. This only has to happen
+// when the alarms or the clock get changed, or the last one went off
+void alarm_schedule(void) {
+  uint8_t i, day, sreg;
+  uint16_t now, mow, wait;
+  uint16_t next = MOW_NONE, soonest = MINS_PER_WEEK;
+
+  sreg = SREG;
+  cli();
+  now = clock_mow;
+  SREG = sreg;
+
+  for (i = 0; i < ALARMS; i++) {
+    // unused slots are left erased
+    if ((alarms[i].h > 23) || (alarms[i].m > 59))
+      continue;
+    for (day = 0; day < 7; day++) {
+      if (! (alarms[i].days & _BV(day)))
+	continue;
+      mow = day * MINS_PER_DAY + alarms[i].h * 60 + alarms[i].m;
+      // minutes from now, an alarm for right now is a week away
+      wait = (mow + MINS_PER_WEEK - now - 1) % MINS_PER_WEEK;
+      if (wait < soonest) {
+	soonest = wait;
+	next = mow;
+      }
+    }
+  }
+
+  sreg = SREG;
+  cli();
+  alarm_next = next;
+  SREG = sreg;
+}
+
+// Work out the minute of the week from scratch, for when the time or
+// date has been set. After this the RTC keeps it going
+void clock_sync(void) {
+  uint8_t sreg = SREG;
+
+  cli();
+  clock_mow = dayofweek(date_y, date_m, date_d) * MINS_PER_DAY +
+    time_h * 60 + time_m;
+  SREG = sreg;
+  alarm_schedule();
+}
+
 // This turns on/off the alarm when the switch has been
 // set. It also displays the alarm time
 void setalarmstate(void) {
-  if (ALARM_PIN & _BV(ALARM)) { 
+  if (pin_read(ALARM)) {
     // Don't display the alarm/beep if we already have
     if  (!alarm_on) {
       // alarm on!
@@ -1265,12 +1417,8 @@ void setalarmstate(void) {
       display_str("alarm on");
       // its not actually SHOW_SNOOZE but just anything but SHOW_TIME
       displaymode = SHOW_SNOOZE;
-      delayms(1000);
-      // show the current alarm time set
-      display_alarm(alarm_h, alarm_m);
-      delayms(1000);
-      // after a second, go back to clock mode
-      displaymode = SHOW_TIME;
+      // then the alarm time, then back to the clock
+      status_show(STATUS_ALARMTIME, 1000);
     }
   } else {
     if (alarm_on) {
@@ -1283,12 +1431,35 @@ void setalarmstate(void) {
 	DEBUGP("alarm off");
 	alarming = 0;
 	TCCR1B &= ~_BV(CS11); // turn it off!
-	PORTB |= _BV(SPK1) | _BV(SPK2);
+	pin_high(SPK1);
+	pin_high(SPK2);
       } 
     }
   }
 }
 
+// Day of the week for a 20xx date, sunday is 0
+uint8_t dayofweek(uint8_t y, uint8_t m, uint8_t d) {
+  uint16_t month, year;
+
+  month = m;
+  year = 2000 + y;
+  if (m < 3)  {
+    month += 12;
+    year -= 1;
+  }
+  return (d + (2 * month) + (6 * (month+1)/10) + year + (year/4) - (year/100) + (year/400) + 1) % 7;
+}
+
+// How many days in month m of 20yy
+uint8_t monthdays(uint8_t m, uint8_t y) {
+  if (m == 2)
+    return leapyear(2000 + y) ? 29 : 28;
+  if ((m == 4) || (m == 6) || (m == 9) || (m == 11))
+    return 30;
+  return 31;
+}
+
 // This will calculate leapyears, give it the year
 // and it will return 1 (true) or 0 (false)
 uint8_t leapyear(uint16_t y) {
@@ -1304,7 +1475,8 @@ void speaker_init(void) {
   volume = eeprom_read_byte((uint8_t *)EE_VOLUME);
 
   // We use the built-in fast PWM, 8 bit timer
-  PORTB |= _BV(SPK1) | _BV(SPK2); 
+  pin_high(SPK1);
+  pin_high(SPK2);
 
   // Turn on PWM outputs for both pins
   TCCR1A = _BV(COM1B1) | _BV(COM1B0) | _BV(WGM11);
@@ -1313,35 +1485,85 @@ void speaker_init(void) {
   } 
   TCCR1B = _BV(WGM13) | _BV(WGM12);
 
-  // start at 4khz:  250 * 8 multiplier * 4000 = 8mhz
-  ICR1 = 250;
+  // start at 4khz
+  ICR1 = TONE(ALARM_HZ);
   OCR1B = OCR1A = ICR1 / 2;
 }
 
 // This makes the speaker tick, it doesnt use PWM
 // instead it just flicks the piezo
+// The pulses are one button scan long each, buttons_scan() moves it along
 void tick(void) {
   TCCR1A = 0;
   TCCR1B = 0;
 
   // Send a pulse thru both pins, alternating
-  SPK_PORT |= _BV(SPK1);
-  SPK_PORT &= ~_BV(SPK2);
-  delayms(10);
-  SPK_PORT |= _BV(SPK2);
-  SPK_PORT &= ~_BV(SPK1);
-  delayms(10);
+  pin_high(SPK1);
+  pin_low(SPK2);
+  clicking = 2;
+}
+
+void tick_service(void) {
+  if (--clicking) {
+    pin_high(SPK2);
+    pin_low(SPK1);
+    return;
+  }
   // turn them both off
-  SPK_PORT &= ~_BV(SPK1) & ~_BV(SPK2);
+  pin_low(SPK1);
+  pin_low(SPK2);
 
   TCCR1A = _BV(COM1A1) | _BV(COM1B1) | _BV(COM1B0) | _BV(WGM11);
   TCCR1B = _BV(WGM13) | _BV(WGM12);
 }
 
-// We can play short beeps!
-void beep(uint16_t freq, uint8_t times) {
+// Start playing a tune in the background
+void beep_tune(const uint16_t *t) {
+  uint8_t sreg = SREG;
+
+  cli();
+  tune_on = 0;
+  tune_deadline = ticks;
+  tune = t;
+  SREG = sreg;
+}
+
+// Called from the mux interrupt while a tune is playing
+void tune_service(void) {
+  uint16_t top;
+
+  if (!timer_expired(tune_deadline))
+    return;
+  tune_deadline += MS_TO_TICKS(200);
+
+  if (tune_on) {
+    TCCR1B &= ~_BV(CS11); // turn it off!
+    pin_low(SPK1);
+    pin_low(SPK2);
+    tune_on = 0;
+    return;
+  }
+
+  top = pgm_read_word(tune);
+  if (!top) {
+    tune = 0;
+    return;
+  }
+  tune++;
+
+  // set the PWM output to match the desired frequency
+  ICR1 = top;
+  // we want 50% duty cycle square wave
+  OCR1A = OCR1B = ICR1/2;
+  TCCR1B |= _BV(CS11); // turn it on!
+  tune_on = 1;
+}
+
+// We can play short beeps! (this one waits till they're done)
+// top is TONE(frequency)
+void beep(uint16_t top, uint8_t times) {
   // set the PWM output to match the desired frequency
-  ICR1 = (F_CPU/8)/freq;
+  ICR1 = top;
   // we want 50% duty cycle square wave
   OCR1A = OCR1B = ICR1/2;
    
@@ -1350,12 +1572,14 @@ void beep(uint16_t freq, uint8_t times) {
     // beeps are 200ms long on
     _delay_ms(200);
     TCCR1B &= ~_BV(CS11); // turn it off!
-    PORTB &= ~_BV(SPK1) & ~_BV(SPK2);
+    pin_low(SPK1);
+    pin_low(SPK2);
     // beeps are 200ms long off
     _delay_ms(200);
   }
   // turn speaker off
-  PORTB &= ~_BV(SPK1) & ~_BV(SPK2);
+  pin_low(SPK1);
+  pin_low(SPK2);
 }
 
 
@@ -1365,14 +1589,18 @@ void dimmer_init(void) {
   dimmer_on = eeprom_read_byte((uint8_t *)EE_DIMMER);
 
   // Power for the photoresistor
-  DIMMER_POWER_DDR |= _BV(DIMMER_POWER_PIN); 
-  DIMMER_POWER_PORT |= _BV(DIMMER_POWER_PIN);
+  pin_output(DIMMER_POWER);
+  pin_high(DIMMER_POWER);
 
+#if (F_CPU > 12800000)
+  ADCSRA |= _BV(ADPS2)| _BV(ADPS1) | _BV(ADPS0); // Set ADC prescalar to 128 - 125KHz sample rate @ 16MHz F_CPU
+#else
   ADCSRA |= _BV(ADPS2)| _BV(ADPS1); // Set ADC prescalar to 64 - 125KHz sample rate @ 8MHz F_CPU
+#endif
   ADMUX |= _BV(REFS0);  // Set ADC reference to AVCC
   ADMUX |= _BV(ADLAR);  // Left adjust ADC result to allow easy 8 bit reading
-  ADMUX |= _BV(DIMMER_SENSE_PIN);   // Set ADC input as ADC4 (PC4)
-  DIDR0 |= _BV(DIMMER_SENSE_PIND); // Disable the digital imput buffer on the sense pin to save power.
+  ADMUX |= PIN_NUM(DIMMER_SENSE);   // Set ADC input as ADC4 (PC4)
+  DIDR0 |= PIN_MASK(DIMMER_SENSE); // Disable the digital imput buffer on the sense pin to save power.
   ADCSRA |= _BV(ADEN);  // Enable ADC
   ADCSRA |= _BV(ADIE);  // Enable ADC interrupt
 }
@@ -1394,6 +1622,540 @@ SIGNAL(SIG_ADC) {
   }
 } 
 
+/**************************** GPS *****************************/
+
+// A GPS module (at the same baud rate) can be wired to the serial port
+// to keep the clock right. Sentences start with '$' so the receive
+// interrupt can tell them from our own frames, and get handed to
+// nmea_rx() a character at a time as they come in. We only pick the
+// time and date out of $--RMC and $--ZDA on the fly, nothing is kept
+// but the numbers. Once a sentence checks out the clock is compared to
+// it: more than a second out and we set it, otherwise we just note how
+// far the crystal has wandered since we did, which is the drift.
+// ZDA doesn't say if the receiver has a fix, so it only counts for
+// NMEA_FIX_AGE seconds after an RMC that said it had
+
+uint8_t nmea_type, nmea_field, nmea_pos, nmea_sum, nmea_check, nmea_have;
+uint8_t nmea_val[6];   // UTC h, m, s, d, m, y
+char nmea_name[3];     // the type, "RMC"
+uint8_t nmea_fix = 0;  // the last RMC had a fix
+uint32_t nmea_fixat;   // and rtc_uptime when it came
+
+// how the clock compares to GPS
+volatile uint8_t gps_locked = 0;    // we've set the clock from GPS
+volatile uint8_t gps_resynced = 0;  // and main() has to save it
+volatile int16_t gps_error;         // in 1/256ths of a second, + is fast
+volatile uint32_t gps_since;        // rtc_uptime when we last set it
+
+// The time zone, in 15 minute steps from UTC. A copy of EE_TZ so the
+// receive interrupt never reads the EEPROM: an eeprom_write_byte() in
+// main() that it landed in would go to the wrong address
+int8_t gps_tz = 0;
+
+// Pick up the time zone, at startup and when it's been changed
+void nmea_init(void) {
+  gps_tz = eeprom_read_byte((uint8_t *)EE_TZ);
+  if ((uint8_t)gps_tz == 0xFF)
+    gps_tz = 0;  // never been set
+}
+
+void nmea_start(void) {
+  nmea_type = NMEA_OTHER;
+  nmea_field = nmea_pos = 0;
+  nmea_sum = nmea_check = nmea_have = 0;
+}
+
+// Add the digit c to a two digit field, 'got' is set once its finished
+void nmea_digit(uint8_t *v, char c, uint8_t got) {
+  if ((c < '0') || (c > '9')) {
+    nmea_type = NMEA_OTHER;  // junk, forget this sentence
+    return;
+  }
+  *v = (*v % 10) * 10 + (c - '0');
+  if (nmea_pos & 1)
+    nmea_have |= got;
+}
+
+// Take the next character of a sentence. Returns 0 when its over
+uint8_t nmea_rx(char c) {
+  if ((c == '\r') || (c == '\n')) {
+    if ((nmea_field != NMEA_CHECKSUM) || (nmea_pos != 2) ||
+	(nmea_check != nmea_sum))
+      return 0;
+    if (nmea_type == NMEA_RMC) {
+      nmea_fix = nmea_have & NMEA_FIX;
+      nmea_fixat = rtc_uptime;
+    } else if ((nmea_type == NMEA_ZDA) && nmea_fix &&
+	       (rtc_uptime - nmea_fixat <= NMEA_FIX_AGE)) {
+      nmea_have |= NMEA_FIX;
+    }
+    if (nmea_have == NMEA_ALL)
+      nmea_done();
+    return 0;
+  }
+
+  if (nmea_field == NMEA_CHECKSUM) {
+    // two hex digits after the '*'
+    nmea_check = (nmea_check << 4) | ((c <= '9') ? (c - '0') : (c - 'A' + 10));
+    nmea_pos++;
+    return (nmea_pos <= 2);
+  }
+  if (c == '*') {
+    nmea_field = NMEA_CHECKSUM;
+    nmea_pos = 0;
+    return 1;
+  }
+
+  nmea_sum ^= c;
+  if (c == ',') {
+    if (!nmea_field) {
+      // "GPRMC", we don't care who the talker is
+      if (nmea_pos == 5) {
+	if ((nmea_name[0] == 'R') && (nmea_name[1] == 'M') &&
+	    (nmea_name[2] == 'C'))
+	  nmea_type = NMEA_RMC;
+	else if ((nmea_name[0] == 'Z') && (nmea_name[1] == 'D') &&
+		 (nmea_name[2] == 'A'))
+	  nmea_type = NMEA_ZDA;
+      }
+      if (nmea_type == NMEA_OTHER)
+	return 0;  // not one of ours
+    }
+    nmea_field++;
+    nmea_pos = 0;
+    return 1;
+  }
+
+  if (!nmea_field) {
+    if ((nmea_pos >= 2) && (nmea_pos < 5))
+      nmea_name[nmea_pos - 2] = c;
+  } else if (nmea_field == 1) {
+    // hhmmss.ss
+    if (nmea_pos < 6)
+      nmea_digit(&nmea_val[nmea_pos / 2], c, NMEA_TIME);
+  } else if (nmea_type == NMEA_RMC) {
+    if ((nmea_field == 2) && (c == 'A'))
+      nmea_have |= NMEA_FIX;
+    else if ((nmea_field == 9) && (nmea_pos < 6))  // ddmmyy
+      nmea_digit(&nmea_val[3 + nmea_pos / 2], c, NMEA_DATE);
+  } else if (nmea_type == NMEA_ZDA) {
+    // dd,mm,yyyy and no fix status, see above
+    if ((nmea_field == 2) && (nmea_pos < 2))
+      nmea_digit(&nmea_val[3], c, 0);
+    else if ((nmea_field == 3) && (nmea_pos < 2))
+      nmea_digit(&nmea_val[4], c, 0);
+    else if ((nmea_field == 4) && (nmea_pos < 4))
+      nmea_digit(&nmea_val[5], c, NMEA_DATE);
+  }
+  nmea_pos++;
+  return 1;
+}
+
+// A good sentence just ended, set or check the clock. Called with
+// interrupts off
+void nmea_done(void) {
+  uint8_t h, m, s, d, mo, y, phase;
+  int16_t mins;
+  int32_t err;
+
+  // where we are in the current second, before anything else
+  phase = TCNT2;
+
+  // UTC to local time
+  mins = nmea_val[0] * 60 + nmea_val[1] + gps_tz * 15;
+  s = nmea_val[2];
+  d = nmea_val[3];
+  mo = nmea_val[4];
+  y = nmea_val[5];
+  if ((mo < 1) || (mo > 12) || (d < 1))
+    return;
+  if (mins < 0) {
+    // yesterday
+    mins += MINS_PER_DAY;
+    if (--d == 0) {
+      if (--mo == 0) {
+	mo = 12;
+	y = (y + 99) % 100;
+      }
+      d = monthdays(mo, y);
+    }
+  } else if (mins >= MINS_PER_DAY) {
+    // tomorrow
+    mins -= MINS_PER_DAY;
+    if (++d > monthdays(mo, y)) {
+      d = 1;
+      if (++mo > 12) {
+	mo = 1;
+	y = (y + 1) % 100;
+      }
+    }
+  }
+  h = mins / 60;
+  m = mins % 60;
+
+  if (gps_locked && (d == date_d) && (mo == date_m) && (y == date_y)) {
+    err = ((int32_t)time_h * 3600 + time_m * 60 + time_s) -
+      ((int32_t)h * 3600 + m * 60 + s);
+    err = err * 256 + phase;
+    // and the part of a second the trim has put by but not added in yet
+    err += rtc_trimacc / (TRIM_SECOND / 256);
+    if ((err > -256) && (err < 256)) {
+      // close enough, just keep track of how far off we are
+      gps_error = err;
+      return;
+    }
+  }
+
+  // set the clock, the second starts now
+  TCNT2 = 0;
+  while (ASSR & _BV(TCN2UB));
+  TIFR2 = _BV(TOV2);
+
+  time_h = h;
+  time_m = m;
+  time_s = s;
+  date_d = d;
+  date_m = mo;
+  date_y = y;
+
+  rtc_trimacc = 0;
+  gps_error = 0;
+  gps_since = rtc_uptime;
+  gps_locked = 1;
+  gps_resynced = 1;
+}
+
+// Save the time after GPS set the clock
+void nmea_service(void) {
+  if (!gps_resynced)
+    return;
+  gps_resynced = 0;
+
+  eeprom_write_byte((uint8_t *)EE_HOUR, time_h);
+  eeprom_write_byte((uint8_t *)EE_MIN, time_m);
+  eeprom_write_byte((uint8_t *)EE_SEC, time_s);
+  eeprom_write_byte((uint8_t *)EE_YEAR, date_y);
+  eeprom_write_byte((uint8_t *)EE_MONTH, date_m);
+  eeprom_write_byte((uint8_t *)EE_DAY, date_d);
+  timeunknown = 0;
+  clock_sync();
+}
+
+/**************************** SERIAL *****************************/
+
+// Clocks can be set up over the serial port instead of with the buttons,
+// see ivset.pl, or kept right by GPS (see below). Our commands come in
+// framed as
+//   SER_SYNC, command, length, 'length' bytes of data, checksum
+// where the checksum makes command + length + data + checksum add up
+// to 0. Replies come back framed the same way, with the top bit of the
+// command set (or SER_NAK). The receive interrupt only collects a frame
+// and main() runs it, except for setting the time which has to happen
+// right as the frame ends to get the clock to the second
+
+uint8_t ser_state = SER_IDLE;
+uint8_t ser_cmd, ser_len, ser_count, ser_sum;
+uint8_t ser_data[SER_MAX];
+volatile uint8_t ser_ready = 0;   // there's a frame waiting for main()
+volatile uint8_t ser_errors = 0;  // bad frames, or ones we had no room for
+
+void serial_init(void) {
+  uart_init(SER_BRR);
+  UCSR0B |= _BV(RXCIE0);
+}
+
+SIGNAL (USART_RX_vect) {
+  uint8_t c = UDR0;
+
+  switch (ser_state) {
+  case SER_IDLE:
+    // anything between frames is ignored
+    if (c == SER_SYNC) {
+      ser_state = SER_CMD;
+    } else if (c == '$') {
+      nmea_start();
+      ser_state = SER_NMEA;
+    }
+    break;
+  case SER_NMEA:
+    if (!nmea_rx(c))
+      ser_state = SER_IDLE;
+    break;
+  case SER_CMD:
+    if (ser_ready) {
+      // main() is still busy with the last one
+      ser_errors++;
+      ser_state = SER_IDLE;
+      break;
+    }
+    ser_cmd = ser_sum = c;
+    ser_state = SER_LEN;
+    break;
+  case SER_LEN:
+    if (c > SER_MAX) {
+      ser_errors++;
+      ser_state = SER_IDLE;
+      break;
+    }
+    ser_len = c;
+    ser_sum += c;
+    ser_count = 0;
+    ser_state = c ? SER_DATA : SER_CHECK;
+    break;
+  case SER_DATA:
+    ser_data[ser_count++] = c;
+    ser_sum += c;
+    if (ser_count == ser_len)
+      ser_state = SER_CHECK;
+    break;
+  default:
+    ser_state = SER_IDLE;
+    if ((uint8_t)(ser_sum + c) != 0) {
+      ser_errors++;
+      break;
+    }
+    if (ser_cmd == CMD_SETTIME)
+      serial_settime();
+    ser_ready = 1;
+  }
+}
+
+// Set the clock from a CMD_SETTIME frame, { h, m, s, y, m, d }. The
+// second starts now, the frame is sent so that it ends right as the
+// host's clock ticks over. Called with interrupts off
+void serial_settime(void) {
+  uint8_t *d = ser_data;
+
+  if ((ser_len != 6) || (d[0] > 23) || (d[1] > 59) || (d[2] > 59) ||
+      (d[3] > 99) || !d[4] || (d[4] > 12) || !d[5] || (d[5] > 31)) {
+    ser_len = 0;  // main() will NAK it
+    return;
+  }
+
+  TCNT2 = 0;
+  while (ASSR & _BV(TCN2UB));
+  TIFR2 = _BV(TOV2);  // and forget about any overflow that was coming
+  rtc_trimacc = 0;
+
+  time_h = d[0];
+  time_m = d[1];
+  time_s = d[2];
+  date_y = d[3];
+  date_m = d[4];
+  date_d = d[5];
+}
+
+void serial_reply(uint8_t cmd, uint8_t *data, uint8_t len) {
+  uint8_t sum = cmd + len;
+
+  uart_putchar(SER_SYNC);
+  uart_putchar(cmd);
+  uart_putchar(len);
+  while (len--) {
+    sum += *data;
+    uart_putchar(*data++);
+  }
+  uart_putchar(-sum);
+}
+
+// Pick up settings that were written to EEPROM behind our back
+void serial_reload(void) {
+  brightness_level = eeprom_read_byte((uint8_t *)EE_BRIGHT);
+  region = eeprom_read_byte((uint8_t *)EE_REGION);
+  dimmer_on = eeprom_read_byte((uint8_t *)EE_DIMMER);
+  speaker_init();  // reads the volume
+  if (dimmer_on)
+    dimmer_update();
+  else
+    set_vfd_brightness(brightness_level);
+  alarm_init();
+  alarm_schedule();
+  nmea_init();
+}
+
+// Run a command that came in over the serial port, if there is one
+void serial_service(void) {
+  uint8_t reply[SER_MAX];
+  uint8_t i, n = 0, ok = 1, sreg;
+  // EEPROM addresses are 2 bytes, low first, EE_SIZE is more than 256
+  uint16_t addr = ser_data[0] | (ser_data[1] << 8);
+  uint8_t count = ser_len - 2;
+
+  if (!ser_ready)
+    return;
+
+  switch (ser_cmd) {
+  case CMD_PING:
+    reply[n++] = SER_VERSION;
+    break;
+  case CMD_SETTIME:
+    // the interrupt did the clock, we just have to save it
+    if (ser_len != 6) {
+      ok = 0;
+      break;
+    }
+    eeprom_write_byte((uint8_t *)EE_HOUR, time_h);
+    eeprom_write_byte((uint8_t *)EE_MIN, time_m);
+    eeprom_write_byte((uint8_t *)EE_SEC, time_s);
+    eeprom_write_byte((uint8_t *)EE_YEAR, date_y);
+    eeprom_write_byte((uint8_t *)EE_MONTH, date_m);
+    eeprom_write_byte((uint8_t *)EE_DAY, date_d);
+    timeunknown = 0;
+    clock_sync();
+    break;
+  case CMD_GETTIME:
+    sreg = SREG;
+    cli();
+    reply[n++] = time_h;
+    reply[n++] = time_m;
+    reply[n++] = time_s;
+    reply[n++] = date_y;
+    reply[n++] = date_m;
+    reply[n++] = date_d;
+    SREG = sreg;
+    break;
+  case CMD_GPS:
+    // { locked, error (2 bytes), seconds since it was set (4 bytes) }
+    sreg = SREG;
+    cli();
+    reply[n++] = gps_locked;
+    reply[n++] = gps_error;
+    reply[n++] = gps_error >> 8;
+    for (i = 0; i < 4; i++)
+      reply[n++] = (rtc_uptime - gps_since) >> (8 * i);
+    SREG = sreg;
+    break;
+  case CMD_TRIM:
+    // { trim (2 bytes) } sets it, then either way we say what it is
+    if (ser_len == 2)
+      rtc_settrim(ser_data[0] | (ser_data[1] << 8));
+    else if (ser_len) {
+      ok = 0;
+      break;
+    }
+    reply[n++] = rtc_trim;
+    reply[n++] = rtc_trim >> 8;
+    break;
+  case CMD_READ:
+    // { addr (2 bytes), count } -> count bytes of EEPROM
+    count = ser_data[2];
+    if ((ser_len != 3) || (count > SER_MAX) || (addr + count > EE_SIZE)) {
+      ok = 0;
+      break;
+    }
+    for (n = 0; n < count; n++)
+      reply[n] = eeprom_read_byte((uint8_t *)(uintptr_t)(addr + n));
+    break;
+  case CMD_WRITE:
+    // { addr (2 bytes), bytes... } for setting up a whole block of
+    // settings at once
+    if ((ser_len < 2) || (addr + count > EE_SIZE)) {
+      ok = 0;
+      break;
+    }
+    for (i = 0; i < count; i++)
+      if (eeprom_read_byte((uint8_t *)(uintptr_t)(addr + i)) != ser_data[i+2])
+	eeprom_write_byte((uint8_t *)(uintptr_t)(addr + i), ser_data[i+2]);
+    serial_reload();
+    break;
+  default:
+    ok = 0;
+  }
+
+  if (ok)
+    serial_reply(ser_cmd | 0x80, reply, n);
+  else
+    serial_reply(SER_NAK, &ser_cmd, 1);
+  ser_ready = 0;
+}
+
+/**************************** POWER *****************************/
+
+// Which peripherals each power mode can do without. Everything listed
+// here is clock gated through PRR, anything not listed keeps running.
+// In both modes timer 2 (the RTC) and the analog comparator (power
+// sense) stay on, the comparator only uses the bandgap and AIN1 so it
+// doesn't need the ADC clock
+const uint8_t power_prr[] PROGMEM = {
+  // POWER_RUN: we never use the TWI
+  _BV(PRTWI),
+  // POWER_BATTERY: no display mux/boost, buzzer, vfd, uart or dimmer
+  _BV(PRTWI) | _BV(PRTIM0) | _BV(PRTIM1) | _BV(PRSPI) | _BV(PRUSART0) | _BV(PRADC),
+};
+
+// Digital input buffers we can turn off in each mode. AIN1 is the supply
+// sense so its buffer is never needed, the photocell sense pin only
+// needs its buffer off while the ADC reads it, and on battery nothing
+// reads port C at all
+const uint8_t power_didr0[] PROGMEM = {
+  PIN_MASK(DIMMER_SENSE),
+  _BV(ADC5D) | _BV(ADC4D) | _BV(ADC3D) | _BV(ADC2D) | _BV(ADC1D) | _BV(ADC0D),
+};
+
+// The ADC has to be switched off before we gate its clock. Nothing puts
+// it back here, coming off battery is always through main() again and
+// dimmer_init() sets it up
+void power_set(uint8_t mode) {
+  if (mode == POWER_BATTERY)
+    ADCSRA = 0;
+
+  PRR = pgm_read_byte(power_prr + mode);
+  DIDR0 = pgm_read_byte(power_didr0 + mode);
+  DIDR1 = _BV(AIN1D);
+}
+
+/**************************** POWER FAIL *****************************/
+
+// When the mains goes away the time has to reach EEPROM before the supply
+// collapses. eeprom_write_byte() erases and writes, 3.4ms a byte, so we
+// keep a slot erased ahead of time and on power fail only program into
+// it (1.8ms a byte). The check byte goes last and the slot only counts
+// if it matches, so a save the supply didn't last through is ignored.
+// The last byte is left to finish after we return: one erase-and-write
+// that was already going plus three write-only cycles, 8.8ms at worst.
+
+// Start one EEPROM operation, EEPM0 = erase only, EEPM1 = write only
+void pf_program(uint8_t addr, uint8_t data, uint8_t mode) {
+  uint8_t sreg = SREG;
+
+  while (EECR & _BV(EEPE));  // wait for the last one to finish
+  EEAR = addr;
+  EEDR = data;
+  cli();  // EEPE has to follow EEMPE within 4 cycles
+  EECR = mode | _BV(EEMPE);
+  EECR |= _BV(EEPE);
+  SREG = sreg;
+}
+
+// Called with the loads already off, writes the time into the erased slot
+void pf_save(void) {
+  uint8_t m = time_m, s = time_s;
+
+  pf_program(EE_PF_MIN, m, _BV(EEPM1));
+  pf_program(EE_PF_SEC, s, _BV(EEPM1));
+  pf_program(EE_PF_CHECK, ~(m + s), _BV(EEPM1));
+}
+
+// At startup, take the time from the slot if there is one and erase it
+void pf_restore(void) {
+  uint8_t m, s, c;
+
+  m = eeprom_read_byte((uint8_t *)EE_PF_MIN);
+  s = eeprom_read_byte((uint8_t *)EE_PF_SEC);
+  c = eeprom_read_byte((uint8_t *)EE_PF_CHECK);
+  if ((m < 60) && (s < 60) && (c == (uint8_t)~(m + s))) {
+    time_m = m;
+    time_s = s;
+    eeprom_write_byte((uint8_t *)EE_MIN, time_m);
+    eeprom_write_byte((uint8_t *)EE_SEC, time_s);
+  }
+  if ((m != 0xFF) || (s != 0xFF) || (c != 0xFF)) {
+    pf_program(EE_PF_MIN, 0xFF, _BV(EEPM0));
+    pf_program(EE_PF_SEC, 0xFF, _BV(EEPM0));
+    pf_program(EE_PF_CHECK, 0xFF, _BV(EEPM0));
+  }
+}
+
 /**************************** BOOST *****************************/
 
 // We control the boost converter by changing the PWM output
@@ -1434,103 +2196,202 @@ void set_vfd_brightness(uint8_t brightness) {
   OCR0A = brightness;
 }
 
+/**************************** STOPWATCH *****************************/
+
+// A stopwatch (or countdown timer) good to 1/100th of a second. Each mux
+// tick is exactly TICK_US so we just add that up and take off 10ms at a
+// time, there's no error to build up. It shows as "mm.ss.cc" and only
+// the cells that changed get redrawn, usually just the hundredths
+
+// called from the mux interrupt every tick while running
+void stopwatch_tick(void) {
+  uint8_t changed = SW_CELLS_CS;
+
+  sw_us += TICK_US;
+  if (sw_us < 10000)
+    return;
+  sw_us -= 10000;
+
+  if (sw_run == SW_UP) {
+    if (++sw_cs >= 100) {
+      sw_cs = 0;
+      changed |= SW_CELLS_S;
+      if (++sw_s >= 60) {
+	sw_s = 0;
+	changed |= SW_CELLS_M;
+	if (++sw_m >= 100)
+	  sw_m = 0;
+      }
+    }
+  } else {
+    if (sw_cs-- == 0) {
+      sw_cs = 99;
+      changed |= SW_CELLS_S;
+      if (sw_s-- == 0) {
+	sw_s = 59;
+	changed |= SW_CELLS_M;
+	sw_m--;
+      }
+    }
+    if (!sw_m && !sw_s && !sw_cs) {
+      // times up!
+      sw_run = 0;
+      beep_tune(tune_wake);
+    }
+  }
+
+  if (displaymode == SHOW_STOPWATCH)
+    stopwatch_draw(changed);
+}
+
+// draw the parts of the stopwatch in 'cells' (SW_CELLS_*)
+void stopwatch_draw(uint8_t cells) {
+  if (cells & SW_CELLS_CS) {
+    display[6] = pgm_read_byte(numbertable_p + (sw_cs / 10));
+    display[7] = pgm_read_byte(numbertable_p + (sw_cs % 10));
+  }
+  if (cells & SW_CELLS_S) {
+    display[4] = pgm_read_byte(numbertable_p + (sw_s / 10));
+    display[5] = pgm_read_byte(numbertable_p + (sw_s % 10)) | 0x1;
+  }
+  if (cells & SW_CELLS_M) {
+    display[2] = pgm_read_byte(numbertable_p + (sw_m / 10));
+    display[3] = pgm_read_byte(numbertable_p + (sw_m % 10)) | 0x1;
+    // a dash up front when its counting down
+    display[1] = (sw_dir == SW_DOWN) ? 0x2 : 0;
+    display[8] = 0;
+  }
+}
+
+void stopwatch_show(void) {
+  uint8_t sreg = SREG;
+
+  displaymode = SHOW_STOPWATCH;
+  cli();
+  display_attrs(0, 0);
+  stopwatch_draw(SW_CELLS_ALL);
+  SREG = sreg;
+}
+
+// Button 2 starts and stops it. When stopped, button 3 zeros the
+// stopwatch or adds a minute to the countdown (it repeats, for setting
+// long ones) and holding button 2 switches between the two
+void stopwatch_button(uint8_t what) {
+  uint8_t sreg = SREG;
+
+  cli();
+  if (sw_run && ((what == (EV_PRESS | 0x2)) || (what == (EV_LONG | 0x2)))) {
+    sw_run = 0;
+  } else if (what == (EV_PRESS | 0x2)) {
+    if ((sw_dir == SW_UP) || sw_m || sw_s || sw_cs)
+      sw_run = sw_dir;
+  } else if (!sw_run && (what == (EV_LONG | 0x2))) {
+    sw_dir = (sw_dir == SW_UP) ? SW_DOWN : SW_UP;
+    sw_m = sw_s = sw_cs = 0;
+    sw_us = 0;
+  } else if (!sw_run && EV_STEP(what, 0x4)) {
+    sw_s = sw_cs = 0;
+    sw_us = 0;
+    if (sw_dir == SW_DOWN) {
+      if (++sw_m >= 100)
+	sw_m = 0;
+    } else {
+      sw_m = 0;
+    }
+  }
+  stopwatch_draw(SW_CELLS_ALL);
+  SREG = sreg;
+}
+
 /**************************** DISPLAY *****************************/
 
 // We can display the current date!
 void display_date(uint8_t style) {
+  display_attrs(0, 0);
 
   // This type is mm-dd-yy OR dd-mm-yy depending on our pref.
   if (style == DATE) {
-    display[0] = 0;
-    display[6] = display[3] = 0x02;     // put dashes between num
-
-    if (region == REGION_US) {
-      // mm-dd-yy
-      display[1] = pgm_read_byte(numbertable_p + (date_m / 10));
-      display[2] = pgm_read_byte(numbertable_p + (date_m % 10));
-      display[4] = pgm_read_byte(numbertable_p + (date_d / 10));
-      display[5] = pgm_read_byte(numbertable_p + (date_d % 10));
-    } else {
-      // dd-mm-yy
-      display[1] = pgm_read_byte(numbertable_p + (date_d / 10));
-      display[2] = pgm_read_byte(numbertable_p + (date_d % 10));
-      display[4] = pgm_read_byte(numbertable_p + (date_m / 10));
-      display[5] = pgm_read_byte(numbertable_p + (date_m % 10));
-    }
-    // the yy part is the same
-    display[7] = pgm_read_byte(numbertable_p + (date_y / 10));
-    display[8] = pgm_read_byte(numbertable_p + (date_y % 10));
-
+    display_numdate(date_m, date_d, date_y);
   } else if (style == DAY) {
-    // This is more "Sunday June 21" style
-
-    uint16_t month, year;
-    uint8_t dotw;
-
-    // Calculate day of the week
-    
-    month = date_m;
-    year = 2000 + date_y;
-    if (date_m < 3)  {
-      month += 12;
-      year -= 1;
-    }
-    dotw = (date_d + (2 * month) + (6 * (month+1)/10) + year + (year/4) - (year/100) + (year/400) + 1) % 7;
+    // This is more "Sunday June 21" style, too long for the tube so
+    // it scrolls past
+    char str[SCROLL_MAX];
+    uint8_t i;
 
-    // Display the day first
-    display[8] = display[7] = 0;
-    switch (dotw) {
+    switch (dayofweek(date_y, date_m, date_d)) {
     case 0:
-      display_str("sunday"); break;
+      strcpy(str, "sunday "); break;
     case 1:
-      display_str("monday"); break;
+      strcpy(str, "monday "); break;
     case 2:
-      display_str("tuesday"); break;
+      strcpy(str, "tuesday "); break;
     case 3:
-      display_str("wednsday"); break;
+      strcpy(str, "wednesday "); break;
     case 4:
-      display_str("thursday"); break;
+      strcpy(str, "thursday "); break;
     case 5:
-      display_str("friday"); break;
-    case 6:
-      display_str("saturday"); break;
+      strcpy(str, "friday "); break;
+    default:
+      strcpy(str, "saturday "); break;
     }
-    
-    // wait one seconds about
-    delayms(1000);
 
-    // Then display the month and date
-    display[6] = display[5] = display[4] = 0;
     switch (date_m) {
     case 1:
-      display_str("jan"); break;
+      strcat(str, "january "); break;
     case 2:
-      display_str("feb"); break;
+      strcat(str, "february "); break;
     case 3:
-      display_str("march"); break;
+      strcat(str, "march "); break;
     case 4:
-      display_str("april"); break;
+      strcat(str, "april "); break;
     case 5:
-      display_str("may"); break;
+      strcat(str, "may "); break;
     case 6:
-      display_str("june"); break;
+      strcat(str, "june "); break;
     case 7:
-      display_str("july"); break;
+      strcat(str, "july "); break;
     case 8:
-      display_str("augst"); break;
+      strcat(str, "august "); break;
     case 9:
-      display_str("sept"); break;
+      strcat(str, "september "); break;
     case 10:
-      display_str("octob"); break;
+      strcat(str, "october "); break;
     case 11:
-      display_str("novem"); break;
+      strcat(str, "november "); break;
     case 12:
-      display_str("decem"); break;
+      strcat(str, "december "); break;
     }
-    display[7] = pgm_read_byte(numbertable_p + (date_d / 10));
-    display[8] = pgm_read_byte(numbertable_p + (date_d % 10));
-    
+    i = strlen(str);
+    if (date_d >= 10)
+      str[i++] = '0' + (date_d / 10);
+    str[i++] = '0' + (date_d % 10);
+    str[i] = 0;
+
+    scroll_str(str, SCROLL_MS);
+  }
+}
+
+// The mm-dd-yy (or dd-mm-yy) part of display_date(), for any date
+void display_numdate(uint8_t m, uint8_t d, uint8_t y) {
+  display[0] = 0;
+  display[6] = display[3] = 0x02;     // put dashes between num
+
+  if (region == REGION_US) {
+    // mm-dd-yy
+    display[1] = pgm_read_byte(numbertable_p + (m / 10));
+    display[2] = pgm_read_byte(numbertable_p + (m % 10));
+    display[4] = pgm_read_byte(numbertable_p + (d / 10));
+    display[5] = pgm_read_byte(numbertable_p + (d % 10));
+  } else {
+    // dd-mm-yy
+    display[1] = pgm_read_byte(numbertable_p + (d / 10));
+    display[2] = pgm_read_byte(numbertable_p + (d % 10));
+    display[4] = pgm_read_byte(numbertable_p + (m / 10));
+    display[5] = pgm_read_byte(numbertable_p + (m % 10));
   }
+  // the yy part is the same
+  display[7] = pgm_read_byte(numbertable_p + (y / 10));
+  display[8] = pgm_read_byte(numbertable_p + (y % 10));
 }
 
 // This displays a time on the clock
@@ -1597,72 +2458,180 @@ void display_alarm(uint8_t h, uint8_t m){
 }
 
 // display words (menus, prompts, etc)
+// The segments for one character
+uint8_t display_char(char c) {
+  // Numbers and leters are looked up in the font table!
+  if ((c >= 'a') && (c <= 'z'))
+    return pgm_read_byte(alphatable_p + c - 'a');
+  if ((c >= '0') && (c <= '9'))
+    return pgm_read_byte(numbertable_p + c - '0');
+  if (c == '-')
+    return 0x2;
+  return 0;      // spaces and other stuff are ignored :(
+}
+
 void display_str(char *s) {
   uint8_t i;
 
   // don't use the lefthand dot/slash digit
   display[0] = 0;
+  // a new message doesn't blink or dot what was there before
+  display_attrs(0, 0);
 
-  // up to 8 characters
+  // up to 8 characters, use scroll_str() for more
   for (i=1; i<9; i++) {
     // check for null-termination
     if (s[i-1] == 0)
       return;
+    display[i] = display_char(s[i-1]);
+  }
+}
 
-    // Numbers and leters are looked up in the font table!
-    if ((s[i-1] >= 'a') && (s[i-1] <= 'z')) {
-      display[i] =  pgm_read_byte(alphatable_p + s[i-1] - 'a');
-    } else if ((s[i-1] >= '0') && (s[i-1] <= '9')) {
-      display[i] =  pgm_read_byte(numbertable_p + s[i-1] - '0');
-    } else {
-      display[i] = 0;      // spaces and other stuff are ignored :(
-    }
+// Set the attributes and blinking segments of cells 1 to 8, cell 0 is
+// the alarm and pm indicator and looks after itself
+void display_attrs(uint8_t a, uint8_t b) {
+  uint8_t i;
+
+  for (i = 1; i < DISPLAYSIZE; i++) {
+    attr[i] = a;
+    blink[i] = b;
+  }
+}
+
+// Scroll a message of any length (up to SCROLL_MAX) across the tube,
+// moving a cell every 'ms'. It comes in from the right and once it has
+// gone off the left we're back to the clock. The characters are turned
+// into segments here once, so each step is just copying 8 cells no
+// matter how long the message is, and it all happens from the mux tick
+// so nobody has to wait for it
+void scroll_str(char *s, uint16_t ms) {
+  uint8_t sreg = SREG;
+  uint8_t i;
+
+  cli();
+  for (i = 0; (i < SCROLL_MAX) && s[i]; i++)
+    scroll_strip[i] = display_char(s[i]);
+  scroll_len = i;
+  scroll_pos = 0;
+  scroll_rate = scroll_div = MS_TO_TICKS(ms);
+  displaymode = SHOW_SCROLL;
+  status_step = STATUS_NONE; // or it would cut the message short
+  display_str("        ");
+  SREG = sreg;
+}
+
+// called from the mux interrupt while there's a message going
+void scroll_tick(void) {
+  uint8_t i, c;
+
+  // something else (a status, the alarm switch, a menu) has taken over
+  // the display, so the rest of the message would only get in its way
+  if (displaymode != SHOW_SCROLL) {
+    scroll_stop();
+    return;
+  }
+
+  if (--scroll_div)
+    return;
+  scroll_div = scroll_rate;
+
+  if (scroll_pos >= scroll_len + 8) {
+    scroll_stop();
+    return;
+  }
+  scroll_pos++;
+
+  // cell 8 shows strip[scroll_pos - 1], cell 1 is 7 before that
+  c = scroll_pos - 8;
+  for (i = 1; i < 9; i++, c++)
+    display[i] = (c < scroll_len) ? scroll_strip[c] : 0;
+}
+
+// back to the clock, whether the message is done or not
+void scroll_stop(void) {
+  uint8_t sreg = SREG;
+
+  cli();
+  scroll_len = 0;
+  if (displaymode == SHOW_SCROLL) {
+    displaymode = SHOW_TIME;
+    display_time(time_h, time_m, time_s);
   }
+  SREG = sreg;
 }
 
 /************************* LOW LEVEL DISPLAY ************************/
 
 // Setup SPI
 void vfd_init(void) {
+#if (VFD_SPI_DIV == 16)
   SPCR  = _BV(SPE) | _BV(MSTR) | _BV(SPR0);
+#else
+  SPCR  = _BV(SPE) | _BV(MSTR);
+#if (VFD_SPI_DIV == 2)
+  SPSR = _BV(SPI2X);
+#endif
+#endif
 }
 
 // This changes and updates the display
-// We use the digit/segment table to determine which
-// pins on the MAX6921 to turn on
+// We use the digit/segment tables to get the pins on the MAX6921 to
+// turn on, each half of the segments is one lookup
 void setdisplay(uint8_t digit, uint8_t segments) {
-  uint32_t d = 0;  // we only need 20 bits but 32 will do
-  uint8_t i;
+  uint32_t d;  // we only need 20 bits but 32 will do
+  uint8_t chip = 0;
 
-  // Set the digit selection pin
-  d |= _BV(pgm_read_byte(digittable_p + digit));
+#if (VFD_CHIPS > 1)
+  // which tube it's on, and which cell of that
+  chip = digit / TUBE_CELLS;
+  digit -= chip * TUBE_CELLS;
+#endif
 
-  
-  // Set the individual segments for this digit
-  for (i=0; i<8; i++) {
-    if (segments & _BV(i)) {
-      t = 1;
-      t <<= pgm_read_byte(segmenttable_p + i);
-      d |= t;
-    }
-  }
+  d = pgm_read_dword(digitbits + digit);
+  d |= pgm_read_dword(segbits_lo + (segments & 0xF));
+  d |= pgm_read_dword(segbits_hi + (segments >> 4));
 
   // Shift the data out to the display
-  vfd_send(d);
+  vfd_send(d, chip);
 }
 
-// send raw data to display, its pretty straightforward. Just send 32 bits via SPI
-// the bottom 20 define the segments
-void vfd_send(uint32_t d) {
+// send raw data to display, its pretty straightforward. The bottom 20
+// bits of d go to MAX6921 'chip' and the others get zeros. The first
+// bits out go furthest down the chain, so the frame starts with the
+// last chip and chip 0 is its bottom 20 bits
+void vfd_send(uint32_t d, uint8_t chip) {
+#if (VFD_CHIPS == 1)
   // send lowest 20 bits
   cli();       // to prevent flicker we turn off interrupts
   spi_xfer(d >> 16);
   spi_xfer(d >> 8);
   spi_xfer(d);
+#else
+  uint8_t i, j, at;
+
+  // the byte of the frame chip's bits start in, and half way through it
+  // for the odd ones
+  at = (chip * 5) / 2;
+  if (chip & 1)
+    d <<= 4;
+
+  cli();       // to prevent flicker we turn off interrupts
+  for (i = VFD_BYTES; i--; ) {
+    j = i - at;
+    if (j == 2)
+      spi_xfer(d >> 16);
+    else if (j == 1)
+      spi_xfer(d >> 8);
+    else if (j == 0)
+      spi_xfer(d);
+    else
+      spi_xfer(0);
+  }
+#endif
 
   // latch data
-  VFDLOAD_PORT |= _BV(VFDLOAD);
-  VFDLOAD_PORT &= ~_BV(VFDLOAD);
+  pin_high(VFDLOAD);
+  pin_low(VFDLOAD);
   sei();
 }
 
@@ -35,7 +35,73 @@ THE SOFTWARE.
 #define DATE 0  // mm-dd-yy
 #define DAY 1   // thur jan 1
 
-#define DISPLAYSIZE 9
+// The display is VFD_CHIPS tubes of TUBE_CELLS cells, each on its own
+// MAX6921 wired the same way (SEG_* and DIG_* below) and chained from
+// DOUT to DIN. Chip 0 is the one nearest us and has cells 0-8, the
+// clock draws on those and the others are there for whoever wants them.
+// A frame to the chain is 20 bits a chip, rounded up to whole bytes
+#ifndef VFD_CHIPS
+#define VFD_CHIPS 1
+#endif
+#define TUBE_CELLS 9
+#define DISPLAYSIZE (TUBE_CELLS * VFD_CHIPS)
+#define VFD_BYTES ((20 * VFD_CHIPS + 7) / 8)
+
+// A frame goes out with interrupts off, starting just after a timer 0
+// overflow. It has to be done within VFD_FRAME_CLOCKS or the overflow
+// after next comes before we've seen the one in between and a tick is
+// lost (the stopwatch would run slow). The SPI is run at F_CPU/16, or
+// as fast as it needs to be for the frame to fit, up to the MAX6921's
+// 5MHz
+#define VFD_FRAME_CLOCKS 384
+#define VFD_SPI_MAX 5000000
+#if (VFD_BYTES * 8 * 16 <= VFD_FRAME_CLOCKS)
+#define VFD_SPI_DIV 16
+#elif (VFD_BYTES * 8 * 4 <= VFD_FRAME_CLOCKS) && (F_CPU / 4 <= VFD_SPI_MAX)
+#define VFD_SPI_DIV 4
+#elif (VFD_BYTES * 8 * 2 <= VFD_FRAME_CLOCKS) && (F_CPU / 2 <= VFD_SPI_MAX)
+#define VFD_SPI_DIV 2
+#else
+#error "too many MAX6921s to send a frame in VFD_FRAME_CLOCKS"
+#endif
+
+// Attributes for a cell, which the mux interrupt puts on as it shows it
+// so nothing needs redrawing (see attr[] and blink[] in iv.c)
+#define ATTR_DOT 0x1  // light the dot under it
+#define ATTR_DIM 0x2  // only lit for the first quarter of its turn
+#define BLINK_MS 1000 // blinking cells are on this long, then off
+
+// Everything that depends on the cpu clock comes from F_CPU, which has
+// to be a whole number of MHz (8 or 16, see MATRIX in the Makefile)
+#if (F_CPU % 1000000)
+#error "F_CPU has to be a whole number of MHz"
+#endif
+
+// The display mux divides the timer 0 overflow (F_CPU/256, 31.25KHz at
+// 8MHz) by MUX_DIVIDER so the whole display is refreshed about
+// REFRESH_HZ times a second. It also gives us the system tick (see
+// ticks in iv.c), which comes out the same 1056us at 8 or 16MHz with
+// one tube. A cell gets at least MUX_MIN overflows, for its frame to go
+// out and for ATTR_DIM, so with enough cells the refresh rate drops
+// instead. Below REFRESH_MIN_HZ the tube would flicker
+#define REFRESH_HZ 104
+#define REFRESH_MIN_HZ 60
+#define MUX_MIN 4
+#define MUX_FULL (F_CPU / 256 / REFRESH_HZ / DISPLAYSIZE)
+#define MUX_DIVIDER ((MUX_FULL > MUX_MIN) ? MUX_FULL : MUX_MIN)
+#if (F_CPU / 256 / MUX_DIVIDER / DISPLAYSIZE < REFRESH_MIN_HZ)
+#error "too many cells to refresh without flicker"
+#endif
+#define TICK_CLOCKS (256UL * MUX_DIVIDER)
+#define TICK_US (TICK_CLOCKS / (F_CPU / 1000000UL))
+#define MS_TO_TICKS(ms) (((uint32_t)(ms) * 1000 + TICK_US - 1) / TICK_US)
+
+// On battery the RTC runs timer 2 at div 1024 instead of div 128, so it
+// overflows every 8 seconds instead of every second
+#define RTC_SLEEP_STEP 8
+
+// rtc_trim is in 1/100ths of a ppm, so a whole second is 100 million
+#define TRIM_SECOND 100000000L
 
 #define MAXSNOOZE 600 // 10 minutes
 #define INACTIVITYTIMEOUT 10 // how many seconds we will wait before turning off menus
@@ -47,28 +113,155 @@ THE SOFTWARE.
 // Closer to 255 means the room has to be darker for the dimmer to kick in.
 #define DIMMER_THRESHOLD 180 
 
+// Timer 1 counts at F_CPU/8 for the speaker, this is its TOP (ICR1)
+// for a tone. Tunes and beep() take these, not frequencies
+#define TONE(hz) ((F_CPU / 8) / (hz))
+#define ALARM_HZ 4000
+#define ALARM_BEEP_MS 106 // the alarm sounds this long, then is quiet as long
+
 #define BEEP_8KHZ 5
 #define BEEP_4KHZ 10
 #define BEEP_2KHZ 20
 #define BEEP_1KHZ 40
 
+// Button gestures, times are in button scans (BUTTON_SCAN_MS each)
+#define BUTTON_SCAN_MS 10
+#define BUTTON_SCAN_TICKS MS_TO_TICKS(BUTTON_SCAN_MS)
+#define BUTTON_LONG 80          // held this long it's a long press
+#define BUTTON_DOUBLE 30        // second press within this is a double
+#define BUTTON_REPEAT_DELAY 40  // held this long it starts repeating
+#define BUTTON_REPEAT_START 15  // first repeats are this far apart
+#define BUTTON_REPEAT_MIN 2     // and they speed up to this
+
+// Button events are a gesture type ORed with the buttons involved
+#define EV_PRESS 0x00
+#define EV_REPEAT 0x10
+#define EV_LONG 0x20
+#define EV_DOUBLE 0x30
+#define EV_CHORD 0x40
+#define EV_TYPE(what) ((what) & 0xF0)
+#define EV_BUTTONS(what) ((what) & 0x0F)
+// a press or auto-repeat of just button b, for stepping values
+#define EV_STEP(what, b) (((what) == (EV_PRESS | (b))) || ((what) == (EV_REPEAT | (b))))
+
+// The 328P has twice the RAM of the 168, so it gets longer queues and
+// buffers (these are all the RAM beyond the globals and the stack)
+#if (RAMEND > 0x4FF)
+#define BIGRAM 1
+#endif
+
+#ifdef BIGRAM
+#define EVENT_QUEUE 16 // must be a power of 2
+#else
+#define EVENT_QUEUE 8
+#endif
+
+typedef struct {
+  uint8_t what;  // EV_* | buttons
+  uint16_t when; // low half of ticks when it happened
+} input_event_t;
+
+// which buttons (0x1, 0x2, 0x4) get which gestures in a displaymode
+typedef struct {
+  uint8_t repeat;
+  uint8_t longp;
+  uint8_t dbl;
+  uint8_t chord;
+} gesture_t;
+
+// watchdog supervisor tasks, see checkin()
+#define CHECKIN_MAIN 0x1
+#define CHECKIN_MUX 0x2
+#define CHECKIN_ALL (CHECKIN_MAIN | CHECKIN_MUX)
+#define WDT_TIMEOUT WDTO_4S  // the RTC feeds it at most once a second
+
+// alarm table, see alarm_schedule()
+#define ALARMS 4
+#define ALARM_EVERYDAY 0x7F     // days bits, sunday is bit 0
+#define MINS_PER_DAY 1440
+#define MINS_PER_WEEK 10080
+#define MOW_NONE 0xFFFF         // no alarm to go off
+
+typedef struct {
+  uint8_t h, m;
+  uint8_t days;
+} alarm_t;
+
+// power_set() modes
+#define POWER_RUN 0
+#define POWER_BATTERY 1
+
 #define EE_YEAR 1
 #define EE_MONTH 2
 #define EE_DAY 3
 #define EE_HOUR 4
 #define EE_MIN 5
 #define EE_SEC 6
-#define EE_ALARM_HOUR 7 
+#define EE_ALARM_HOUR 7  // only read to fill in EE_ALARMS
 #define EE_ALARM_MIN 8
 #define EE_BRIGHT 9
 #define EE_VOLUME 10
 #define EE_REGION 11
 #define EE_SNOOZE 12
 #define EE_DIMMER 13
+#define EE_PF_MIN 14 // kept erased until the power fails
+#define EE_PF_SEC 15
+#define EE_ALARMS 16  // ALARMS x { hour, min, days }
+#define EE_TZ 28      // GPS time zone, signed 15 minute steps from UTC
+#define EE_TRIM 29    // 2 bytes, crystal trim in 0.01ppm, see rtc_trim
+#define EE_PF_CHECK 31  // ~(min + sec), with EE_PF_MIN and EE_PF_SEC
+#define EE_SIZE (E2END + 1)  // 512 bytes, 1K on the 328P
+
+// serial protocol, see SERIAL in iv.c and ivset.pl
+#define SER_BRR BRRL_192  // BRRL_9600 for most GPS modules
+#define SER_SYNC 0xA5
+#ifdef BIGRAM
+#define SER_MAX 64      // most data bytes in a frame
+#else
+#define SER_MAX 32
+#endif
+#define SER_VERSION 2   // 2 has 2 byte EEPROM addresses
+#define SER_NAK 0xFF    // reply to a command we couldn't do
+
+#define CMD_PING 0x01
+#define CMD_SETTIME 0x02  // { h, m, s, y, m, d }
+#define CMD_GETTIME 0x03
+#define CMD_READ 0x04     // { addr (2 bytes), count }
+#define CMD_WRITE 0x05    // { addr (2 bytes), bytes... }
+#define CMD_GPS 0x06
+#define CMD_TRIM 0x07     // { trim (2 bytes) } or nothing to just read it
+
+// receive states
+#define SER_IDLE 0
+#define SER_CMD 1
+#define SER_LEN 2
+#define SER_DATA 3
+#define SER_CHECK 4
+#define SER_NMEA 5
+
+// GPS sentences, see nmea_rx(). The type is the last 3 letters of the
+// address
+#define NMEA_OTHER 0
+#define NMEA_RMC 1
+#define NMEA_ZDA 2
+#define NMEA_CHECKSUM 0xFF  // nmea_field after the '*'
+#define NMEA_FIX_AGE 2      // seconds a ZDA can go on the last RMC's fix
+// what we've got out of a sentence so far
+#define NMEA_TIME 0x1
+#define NMEA_DATE 0x2
+#define NMEA_FIX 0x4
+#define NMEA_ALL 0x7
 
 void delay(uint16_t delay);
+void delayms(uint16_t ms);
+void kickthedog(void);
+void checkin(uint8_t task);
+
+uint32_t ticks_now(void);
+uint32_t timer_start(uint16_t ms);
+uint8_t timer_expired(uint32_t deadline);
 
-void (*app_start)(void) = 0x0000;
+extern void (*app_start)(void);  // jumps to the reset vector
 
 void clock_init(void);
 void initbuttons(void);
@@ -78,29 +271,67 @@ void set_vfd_brightness(uint8_t brightness);
 void speaker_init(void);
 void dimmer_init(void);
 void dimmer_update(void);
+void power_set(uint8_t mode);
+void pf_program(uint8_t addr, uint8_t data, uint8_t mode);
+void pf_save(void);
+void pf_restore(void);
 
 void display_time(uint8_t h, uint8_t m, uint8_t s);
 void display_date(uint8_t style);
 void display_str(char *s);
+void display_attrs(uint8_t a, uint8_t b);
+uint8_t display_char(char c);
+void scroll_str(char *s, uint16_t ms);
+void scroll_tick(void);
+void scroll_stop(void);
 void display_alarm(uint8_t h, uint8_t m);
+void display_numdate(uint8_t m, uint8_t d, uint8_t y);
 
-void set_time(void);
-void set_alarm(void);
-void set_date(void);
-void set_brightness(void);
-void set_dimmer(void);
-void set_volume(void);
-void set_region(void);
-void set_snooze(void); // not activated by default
+uint8_t menu_wait(void);
+uint8_t menu_run(uint8_t n);
 
-void beep(uint16_t freq, uint8_t times);
+void beep(uint16_t top, uint8_t times);
+void beep_tune(const uint16_t *t);
+void tune_service(void);
 void tick(void);
+void tick_service(void);
+void buttons_scan(void);
+void event_push(uint8_t what);
+uint8_t event_pop(input_event_t *e);
+
+void status_show(uint8_t next, uint16_t ms);
+void status_service(void);
 
 uint8_t leapyear(uint16_t y);
+uint8_t dayofweek(uint8_t y, uint8_t m, uint8_t d);
+uint8_t monthdays(uint8_t m, uint8_t y);
+void alarm_init(void);
+void alarm_schedule(void);
+void clock_sync(void);
+void rtc_advance(uint8_t secs);
+void rtc_setrate(uint8_t step);
+void rtc_settrim(int16_t trim);
 void setalarmstate(void);
 
+void stopwatch_tick(void);
+void stopwatch_draw(uint8_t cells);
+void stopwatch_show(void);
+void stopwatch_button(uint8_t what);
+
+void serial_init(void);
+void serial_settime(void);
+void serial_reply(uint8_t cmd, uint8_t *data, uint8_t len);
+void serial_reload(void);
+void serial_service(void);
+void nmea_init(void);
+void nmea_start(void);
+void nmea_digit(uint8_t *v, char c, uint8_t got);
+uint8_t nmea_rx(char c);
+void nmea_done(void);
+void nmea_service(void);
+
 void setdisplay(uint8_t digit, uint8_t segments);
-void vfd_send(uint32_t d);
+void vfd_send(uint32_t d, uint8_t chip);
 void spi_xfer(uint8_t c);
 
 
@@ -118,65 +349,75 @@ void spi_xfer(uint8_t c);
 #define SHOW_SNOOZE 9
 #define SET_SNOOZE 10
 #define SET_DIMMER 11
-
-// sub-mode settings
-#define SHOW_MENU 0
-// alarm/time
-#define SET_HOUR 1
-#define SET_MIN 2
-#define SET_SEC 3
-// date
-#define SET_MONTH 1
-#define SET_DAY 2
-#define SET_YEAR 3
-//brightness
-#define SET_BRITE 1
-//volume
-#define SET_VOL 1
-//region
-#define SET_REG 1
-//dimmer
-#define SET_DIM 1
-
-#define BOOST PD6
-#define BOOST_DDR DDRD
-#define BOOST_PORT PORTD
-
-#define BUTTON1 PD5
-#define BUTTON2 PB0
-#define BUTTON3 PD4
-
-#define VFDSWITCH PD3
-#define VFDSWITCH_DDR DDRD
-#define VFDSWITCH_PORT PORTD
-#define VFDCLK PB5
-#define VFDCLK_DDR DDRB
-#define VFDCLK_PORT PORTB
-#define VFDDATA PB3
-#define VFDDATA_DDR DDRB
-#define VFDDATA_PORT PORTB
-#define VFDLOAD PC0
-#define VFDLOAD_DDR DDRC
-#define VFDLOAD_PORT PORTC
-#define VFDBLANK PC3
-#define VFDBLANK_DDR DDRC
-#define VFDBLANK_PORT PORTC
-
-#define ALARM PD2
-#define ALARM_DDR DDRD
-#define ALARM_PORT PORTD
-#define ALARM_PIN PIND
-
-#define SPK1 PB1
-#define SPK2 PB2
-#define SPK_PORT PORTB
-#define SPK_DDR DDRB
-
-#define DIMMER_POWER_PORT PORTC
-#define DIMMER_POWER_DDR DDRC
-#define DIMMER_POWER_PIN PC5
-#define DIMMER_SENSE_PIN MUX2
-#define DIMMER_SENSE_PIND ADC4D
+#define SHOW_STOPWATCH 12
+#define SHOW_SCROLL 13
+
+// longest message scroll_str() takes, and how fast it goes by default
+#ifdef BIGRAM
+#define SCROLL_MAX 64
+#else
+#define SCROLL_MAX 32
+#endif
+#define SCROLL_MS 150
+
+// stopwatch directions, and which of its cells need drawing
+#define SW_UP 1
+#define SW_DOWN 2
+#define SW_CELLS_CS 0x1
+#define SW_CELLS_S 0x2
+#define SW_CELLS_M 0x4
+#define SW_CELLS_ALL 0x7
+
+// what status_service() shows next
+#define STATUS_NONE 0
+#define STATUS_ALARMTIME 1
+#define STATUS_DONE 2
+
+// Setting menus, see menutable in iv.c
+#define MENUS 7               // entries in menutable, iv.c checks it
+#define MENU_FIELDS 3
+#define MENU_TITLE 0xFF       // no field picked yet
+#define MENU_POS_REGION 0x80  // pos swaps places for dd-mm vs mm-dd
+#define MENU_HOLD 0x1         // show the result for a bit when done
+
+typedef struct {
+  volatile uint8_t *var;  // where the value lives, 0 for EEPROM only
+  uint8_t min, max, step;
+  uint8_t pos;            // display cell of its first digit, 0 for none
+} menufield_t;
+
+typedef struct {
+  uint8_t mode;                    // displaymode while we're in here
+  char title[10];
+  void (*draw)(uint8_t *v);        // show these values
+  void (*change)(uint8_t *v);      // called as a value changes
+  void (*saved)(void);             // called after the values are stored
+  uint8_t ee;                      // EEPROM address of the first value
+  uint8_t flags;
+  uint8_t fields;
+  menufield_t field[MENU_FIELDS];
+} menu_t;
+
+extern const menu_t menutable[];
+
+// The board's wiring. Each pin is its port letter and bit, and the
+// registers and masks come from that with the PIN_ and pin_ macros
+// in util.h, so a board with something moved (the speaker, the photocell)
+// only needs its line here changed
+#define BOOST D, 6          // OC0A
+#define BUTTON1 D, 5
+#define BUTTON2 B, 0
+#define BUTTON3 D, 4
+#define VFDSWITCH D, 3
+#define VFDCLK B, 5         // SCK
+#define VFDDATA B, 3        // MOSI
+#define VFDLOAD C, 0
+#define VFDBLANK C, 3
+#define ALARM D, 2          // INT0
+#define SPK1 B, 1           // OC1A
+#define SPK2 B, 2           // OC1B
+#define DIMMER_POWER C, 5
+#define DIMMER_SENSE C, 4   // has to be on port C, PCn is ADCn
 
 #define SEG_A 19
 #define SEG_B 17
@@ -197,4 +438,23 @@ void spi_xfer(uint8_t c);
 #define DIG_8 7
 #define DIG_9 3
 
-#define nop asm("nop")
+#if (SEG_A > 19) || (SEG_B > 19) || (SEG_C > 19) || (SEG_D > 19) || \
+  (SEG_E > 19) || (SEG_F > 19) || (SEG_G > 19) || (SEG_H > 19) || \
+  (DIG_1 > 19) || (DIG_2 > 19) || (DIG_3 > 19) || (DIG_4 > 19) || \
+  (DIG_5 > 19) || (DIG_6 > 19) || (DIG_7 > 19) || (DIG_8 > 19) || (DIG_9 > 19)
+#error "the MAX6921 only has outputs 0 to 19"
+#endif
+
+// For building the MAX6921 tables in iv.c at compile time: the outputs
+// for a nibble of display[] bits wired to s0..s3, and a table of one of
+// those for every nibble
+#define _BV32(b) (1UL << (b))
+#define SEGBITS(n, s0, s1, s2, s3) \
+  ((((n) & 0x1) ? _BV32(s0) : 0) | (((n) & 0x2) ? _BV32(s1) : 0) | \
+   (((n) & 0x4) ? _BV32(s2) : 0) | (((n) & 0x8) ? _BV32(s3) : 0))
+#define NIBBLE_TABLE(f) { \
+  f(0), f(1), f(2), f(3), f(4), f(5), f(6), f(7), \
+  f(8), f(9), f(10), f(11), f(12), f(13), f(14), f(15) }
+
+// stops the compiler moving memory accesses from one side to the other
+#define barrier() asm volatile("" ::: "memory")
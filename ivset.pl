@@ -0,0 +1,259 @@
+#!/usr/bin/perl
+# Set up an Ice Tube clock over its serial port (19200 8N2), see the
+# SERIAL part of iv.c for the protocol. Commands can be strung together
+# so a clock gets done in one go, eg.
+#   ivset.pl -p /dev/ttyUSB0 time region us bright 50 alarm 0 7:30 weekdays
+
+use strict;
+use Fcntl;
+use Time::HiRes qw(time sleep);
+
+# from iv.h
+my $SER_SYNC = 0xA5;
+my $SER_NAK = 0xFF;
+my %CMD = (ping => 0x01, settime => 0x02, gettime => 0x03,
+	   read => 0x04, write => 0x05, gps => 0x06,
+	   trim => 0x07);
+my %EE = (bright => 9, volume => 10, region => 11, dimmer => 13,
+	  alarms => 16, tz => 28);
+my %DAYS = (everyday => 0x7F, weekdays => 0x3E, weekends => 0x41,
+	    off => 0x00);
+
+my $port = $ENV{IVPORT} || "/dev/ttyUSB0";
+if ((@ARGV >= 2) && ($ARGV[0] eq "-p")) {
+    shift;
+    $port = shift;
+}
+usage() unless @ARGV;
+
+system("stty -F $port 19200 cs8 cstopb -parenb raw -echo -ixon -crtscts clocal") == 0
+    or die "can't set up $port\n";
+sysopen(TTY, $port, O_RDWR | O_NOCTTY) or die "can't open $port: $!\n";
+
+while (@ARGV) {
+    my $what = shift;
+
+    if ($what eq "ping") {
+	my ($version) = request($CMD{ping});
+	print "clock protocol version $version\n";
+    } elsif ($what eq "time") {
+	settime();
+    } elsif ($what eq "get") {
+	my ($h, $m, $s, $y, $mo, $d) = request($CMD{gettime});
+	printf("20%02d-%02d-%02d %02d:%02d:%02d\n", $y, $mo, $d, $h, $m, $s);
+    } elsif ($what eq "bright") {
+	my $b = shift;
+	die "brightness is 30 to 90\n" unless ($b >= 30) && ($b <= 90);
+	eewrite($EE{bright}, $b - ($b % 5));
+    } elsif ($what eq "volume") {
+	eewrite($EE{volume}, onoff(shift, "high", "low"));
+    } elsif ($what eq "region") {
+	# REGION_US is 0
+	eewrite($EE{region}, onoff(shift, "eu", "us"));
+    } elsif ($what eq "dimmer") {
+	eewrite($EE{dimmer}, onoff(shift, "on", "off"));
+    } elsif ($what eq "alarm") {
+	my $n = shift;
+	my ($h, $m) = split(/:/, shift);
+	my $days = shift;
+	$days = exists($DAYS{$days}) ? $DAYS{$days} : hex($days);
+	die "bad alarm\n" unless ($n < 4) && ($h < 24) && ($m < 60);
+	eewrite($EE{alarms} + 3 * $n, $h, $m, $days);
+    } elsif ($what eq "tz") {
+	# hours from UTC for GPS time, in 15 minute steps
+	my ($sign, $h, $m) = (shift =~ /^([+-]?)(\d+)(?::(\d+))?$/)
+	    or die "time zone is like -5 or +5:30\n";
+	my $q = $h * 4 + int($m / 15);
+	eewrite($EE{tz}, ($sign eq "-") ? (-$q & 0xFF) : $q);
+    } elsif ($what eq "gps") {
+	my ($locked, $lo, $hi, @since) = request($CMD{gps});
+	my $err = unpack("s<", pack("C2", $lo, $hi)) / 256;
+	my $secs = unpack("V", pack("C4", @since));
+	if (!$locked) {
+	    print "no GPS time yet\n";
+	} else {
+	    printf("%+.3f seconds after %d seconds", $err, $secs);
+	    printf(", %+.1f ppm", $err * 1e6 / $secs) if ($secs);
+	    print "\n";
+	}
+    } elsif ($what eq "trim") {
+	# the crystal trim, in ppm (+ speeds the clock up)
+	my $ppm = (@ARGV && ($ARGV[0] =~ /^[+-]?[\d.]+$|^gps$/)) ? shift : undef;
+	my $trim = gettrim();
+	if ($ppm eq "gps") {
+	    # take out whatever drift GPS has seen on top of the current trim
+	    my ($locked, $lo, $hi, @since) = request($CMD{gps});
+	    my $secs = unpack("V", pack("C4", @since));
+	    die "not enough GPS time to go on yet\n" unless $locked && ($secs > 600);
+	    $ppm = $trim / 100 - unpack("s<", pack("C2", $lo, $hi)) / 256 * 1e6 / $secs;
+	}
+	$trim = settrim($ppm) if defined($ppm);
+	printf("trim %+.2f ppm\n", $trim / 100);
+    } elsif ($what eq "measure") {
+	measure(shift);
+    } elsif ($what eq "read") {
+	my ($addr, $count) = (shift, shift);
+	print join(" ", map { sprintf("%02x", $_) }
+		   request($CMD{read}, addr($addr), $count)), "\n";
+    } elsif ($what eq "write") {
+	my $addr = shift;
+	my @bytes;
+	push(@bytes, hex(shift)) while (@ARGV && ($ARGV[0] =~ /^[0-9a-f]+$/i));
+	eewrite($addr, @bytes);
+    } else {
+	usage();
+    }
+}
+exit 0;
+
+# Send the time so the frame ends just as our clock ticks over to the
+# next second, the clock starts that second when it gets the checksum
+sub settime {
+    # 10 bytes at 11 bits each
+    my $frametime = 10 * 11 / 19200;
+    my $next = int(time) + 1;
+    $next++ if ($next - time < $frametime + 0.05);
+    my @t = localtime($next);
+
+    sleep($next - $frametime - time);
+    request($CMD{settime}, $t[2], $t[1], $t[0],
+	    $t[5] % 100, $t[4] + 1, $t[3]);
+}
+
+sub gettrim {
+    return unpack("s<", pack("C2", request($CMD{trim})));
+}
+
+sub settrim {
+    my $trim = sprintf("%.0f", shift() * 100);
+    die "trim is too big\n" if (abs($trim) > 32767);
+    return unpack("s<", pack("C2", request($CMD{trim}, unpack("C2", pack("s<", $trim)))));
+}
+
+# How far ahead of us the clock is, found by waiting for its seconds
+# to tick over. Good to about the time a request takes, 12ms or so
+sub offset {
+    my ($h, $m, $s) = request($CMD{gettime});
+    my ($h2, $m2, $s2, $when);
+
+    do {
+	my $asked = time;
+	($h2, $m2, $s2) = request($CMD{gettime});
+	$when = ($asked + time) / 2;
+    } while ($s2 == $s);
+
+    my @t = localtime(int($when));
+    my $off = ($h2 * 3600 + $m2 * 60 + $s2) -
+	($t[2] * 3600 + $t[1] * 60 + $t[0]) - ($when - int($when));
+    $off -= 86400 if ($off > 43200);
+    $off += 86400 if ($off < -43200);
+    return ($off, $when);
+}
+
+# Time the clock against this computer (which should be on NTP) for a
+# while and work out the trim it needs
+sub measure {
+    my $secs = shift;
+    die "measure for how many seconds?\n" unless $secs > 0;
+
+    my ($off1, $t1) = offset();
+    sleep($secs);
+    my ($off2, $t2) = offset();
+    my $ppm = ($off2 - $off1) * 1e6 / ($t2 - $t1);
+    my $trim = gettrim() / 100;
+    printf("clock is %+.2f ppm with a trim of %+.2f, use \"trim %+.2f\"\n",
+	   $ppm, $trim, $trim - $ppm);
+}
+
+# EEPROM addresses go as 2 bytes, low first, which version 1 clocks
+# would get wrong
+my $version;
+
+sub addr {
+    my $addr = shift;
+
+    ($version) = request($CMD{ping}) unless defined($version);
+    die "the clock has protocol version $version, this needs 2\n"
+	if ($version < 2);
+    return ($addr & 0xFF, $addr >> 8);
+}
+
+sub eewrite {
+    my ($addr, @bytes) = @_;
+
+    request($CMD{write}, addr($addr), @bytes);
+}
+
+sub onoff {
+    my ($arg, $on, $off) = @_;
+
+    return 1 if ($arg eq $on);
+    return 0 if ($arg eq $off);
+    die "expected $on or $off\n";
+}
+
+sub frame {
+    my ($cmd, @data) = @_;
+    my $sum = $cmd + @data;
+
+    $sum += $_ foreach (@data);
+    return pack("C*", $SER_SYNC, $cmd, scalar(@data), @data, -$sum & 0xFF);
+}
+
+sub request {
+    my ($cmd, @data) = @_;
+
+    syswrite(TTY, frame($cmd, @data));
+    my ($reply, @got) = response();
+    die sprintf("clock didn't take command %02x\n", $cmd)
+	if ($reply != ($cmd | 0x80));
+    return @got;
+}
+
+sub getbyte {
+    my ($rin, $c) = ("", "");
+
+    vec($rin, fileno(TTY), 1) = 1;
+    die "no answer from the clock\n" unless select($rin, undef, undef, 1);
+    sysread(TTY, $c, 1);
+    return ord($c);
+}
+
+sub response {
+    my @data;
+
+    # skip over debug messages
+    while (getbyte() != $SER_SYNC) { }
+    my $cmd = getbyte();
+    my $len = getbyte();
+    my $sum = $cmd + $len;
+    for (1..$len) {
+	push(@data, getbyte());
+	$sum += $data[-1];
+    }
+    $sum += getbyte();
+    die "bad checksum from the clock\n" if ($sum & 0xFF);
+    return ($cmd, @data);
+}
+
+sub usage {
+    die <<EOT;
+usage: ivset.pl [-p port] command...
+  ping                       check the clock is there
+  time                       set the time and date from this computer
+  get                        show the clock's time and date
+  bright 30-90               display brightness
+  volume high|low
+  region us|eu
+  dimmer on|off
+  tz +-hh[:mm]               time zone for GPS
+  gps                        how far the clock is from GPS
+  trim [ppm|gps]             show or set the crystal trim, or take it
+                             from what GPS has measured
+  measure secs               time the clock against this computer
+  alarm 0-3 hh:mm days       days is everyday, weekdays, weekends, off or
+                             a hex mask with sunday as bit 0
+  read addr count            dump EEPROM
+  write addr hex...          write EEPROM
+EOT
+}
@@ -29,13 +29,9 @@ THE SOFTWARE.
 
 void delay_10us(uint8_t ns)
 {
-  uint8_t i;
-  
   while (ns != 0) {
     ns--;
-    for (i=0; i< 30; i++) {
-      nop;
-    }
+    _delay_us(10);  // counted out from F_CPU at compile time
   }
 }
 
@@ -51,8 +47,8 @@ void uart_init(uint16_t BRR) {
 
   UCSR0B = _BV(RXEN0) | _BV(TXEN0);
   UCSR0C = _BV(USBS0) | (3<<UCSZ00);
-  DDRD |= _BV(PD1);
-  DDRD &= ~_BV(PD0);
+  pin_output(UART_TX);
+  pin_input(UART_RX);
 
 }
 
@@ -117,40 +113,60 @@ void uart_putdw_hex(uint32_t dw)
     uart_putw_hex((uint16_t) (dw & 0xffff));
 }
 
-void uart_putw_dec(uint16_t w)
+// Decimal without dividing. The AVR has no divide instruction, and the
+// old loops called libgcc's software divide twice a digit (about 650
+// cycles each for 32 bits).
+//
+// 16 bits: w / 10 is (w * 0xCCCD) >> 19 for every 16 bit w, a 16x16
+// multiply the hardware MUL does. Bigger numbers are divided by 10 a
+// half at a time, like long division: with hi / 10 taken out of the top
+// half and r left over, (r * 65536 + lo) / 10 is
+// r * 6553 + lo / 10 + (r * 6 + lo % 10) / 10, where the last part is
+// less than 64 so (x * 13) >> 7 does it. The low half of the answer
+// never passes 65535, it's exact for every 32 bit number (checked them
+// all) and 5 of those steps get anything down to 16 bits.
+void uart_putdw_decpad(uint32_t dw, uint8_t width, char pad)
 {
-    uint16_t num = 10000;
-    uint8_t started = 0;
-
-    while(num > 0)
-    {
-        uint8_t b = w / num;
-        if(b > 0 || started || num == 1)
-        {
-            uart_putc('0' + b);
-            started = 1;
-        }
-        w -= b * num;
-
-        num /= 10;
+    char digits[10];
+    uint8_t n = 0, x, e;
+    uint16_t w, lo, q, r;
+
+    while (dw >> 16) {
+        w = dw >> 16;
+        lo = dw;
+        q = ((uint32_t)w * 0xCCCD) >> 19;
+        r = w - q * 10;
+        w = ((uint32_t)lo * 0xCCCD) >> 19;
+        x = r * 6 + (lo - w * 10);
+        e = (x * 13) >> 7;
+        digits[n++] = '0' + (x - e * 10);
+        dw = ((uint32_t)q << 16) + (r * 6553 + w + e);
     }
+
+    w = dw;
+    do {
+        q = ((uint32_t)w * 0xCCCD) >> 19;
+        digits[n++] = '0' + (w - q * 10);
+        w = q;
+    } while (w);
+
+    while (width-- > n)
+        uart_putc(pad);
+    while (n)
+        uart_putc(digits[--n]);
+}
+
+void uart_putw_decpad(uint16_t w, uint8_t width, char pad)
+{
+    uart_putdw_decpad(w, width, pad);
+}
+
+void uart_putw_dec(uint16_t w)
+{
+    uart_putw_decpad(w, 0, 0);
 }
 
 void uart_putdw_dec(uint32_t dw)
 {
-    uint32_t num = 1000000000;
-    uint8_t started = 0;
-
-    while(num > 0)
-    {
-        uint8_t b = dw / num;
-        if(b > 0 || started || num == 1)
-        {
-            uart_putc('0' + b);
-            started = 1;
-        }
-        dw -= b * num;
-
-        num /= 10;
-    }
+    uart_putdw_decpad(dw, 0, 0);
 }
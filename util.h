@@ -21,13 +21,34 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ****************************************************************************/
 
-#if (F_CPU == 16000000)
-#define BRRL_9600 103    // for 16MHZ
-#define BRRL_192 52    // for 16MHZ
-#elif (F_CPU == 8000000)
-#define BRRL_9600 52
-#define BRRL_192 26    
-#endif
+// UBRR0 for a baud rate (without U2X), rounded to the nearest
+#define BRRL(baud) ((F_CPU + 8UL * (baud)) / (16UL * (baud)) - 1)
+#define BRRL_9600 BRRL(9600)
+#define BRRL_192 BRRL(19200)
+
+// A pin is its port letter and bit, eg. "D, 2", and these get its
+// registers and mask. The extra level expands the pin's name before the
+// letter gets pasted on. Each pin_ macro is one sbi, cbi, sbic or sbis
+// ("make pincheck" checks)
+#define PIN_PORT(...) _PIN_PORT(__VA_ARGS__)
+#define PIN_DDR(...) _PIN_DDR(__VA_ARGS__)
+#define PIN_IN(...) _PIN_IN(__VA_ARGS__)
+#define PIN_NUM(...) _PIN_NUM(__VA_ARGS__)
+#define PIN_MASK(...) _BV(_PIN_NUM(__VA_ARGS__))
+#define _PIN_PORT(l, b) PORT ## l
+#define _PIN_DDR(l, b) DDR ## l
+#define _PIN_IN(l, b) PIN ## l
+#define _PIN_NUM(l, b) (b)
+
+#define pin_output(p) (PIN_DDR(p) |= PIN_MASK(p))
+#define pin_input(p) (PIN_DDR(p) &= ~PIN_MASK(p))
+#define pin_high(p) (PIN_PORT(p) |= PIN_MASK(p))
+#define pin_low(p) (PIN_PORT(p) &= ~PIN_MASK(p))
+#define pin_read(p) (PIN_IN(p) & PIN_MASK(p))
+
+// the USART's pins
+#define UART_RX D, 0
+#define UART_TX D, 1
 
 #define NOP asm("nop");
 #define uart_putc(c) uart_putchar(c)
@@ -46,6 +67,9 @@ void uart_putdw_hex(uint32_t dw);
 
 void uart_putw_dec(uint16_t w);
 void uart_putdw_dec(uint32_t dw);
+// at least width characters, with pad (' ' or '0') in front
+void uart_putw_decpad(uint16_t w, uint8_t width, char pad);
+void uart_putdw_decpad(uint32_t dw, uint8_t width, char pad);
 void uart_puts(const char* str);
 
 void RAM_putstring(char *str);